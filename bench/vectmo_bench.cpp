@@ -0,0 +1,303 @@
+// Microbenchmarks for the Vectmo hot paths: training, embedding, snapping,
+// generation and model I/O. Every input comes from a seeded generator, so runs
+// are reproducible across machines and commits.
+//
+// Build (Google Benchmark):
+//   g++ -std=c++20 -O2 -pthread bench/vectmo_bench.cpp -lbenchmark -o vectmo_bench
+// Run:
+//   ./vectmo_bench --benchmark_filter=Snap
+
+#include "../vectmo.hpp"
+
+#include <benchmark/benchmark.h>
+#include <random>
+#include <set>
+#include <cstdio>
+
+namespace {
+
+    // Random lowercase words, 1-12 chars, biased towards short ones like real text
+    std::vector<std::string> makeWords(size_t count, uint64_t seed) {
+        std::mt19937_64 rng(seed);
+        std::geometric_distribution<int> extraLength(0.3);
+        std::uniform_int_distribution<int> letter('a', 'z');
+
+        std::set<std::string> unique;
+        while (unique.size() < count) {
+            std::string word(1 + std::min(extraLength(rng), 11), ' ');
+            for (char& c : word) c = static_cast<char>(letter(rng));
+            unique.insert(word);
+        }
+        return {unique.begin(), unique.end()};
+    }
+
+    // About `bytes` of text drawn from `vocabularySize` words with a Zipf-like skew
+    std::string makeCorpus(size_t bytes, size_t vocabularySize, uint64_t seed) {
+        auto words = makeWords(vocabularySize, seed);
+        std::mt19937_64 rng(seed + 1);
+        std::vector<double> weights(words.size());
+        for (size_t i = 0; i < weights.size(); ++i) weights[i] = 1.0 / static_cast<double>(i + 1);
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+        std::string corpus;
+        corpus.reserve(bytes + 16);
+        while (corpus.size() < bytes) {
+            corpus += words[pick(rng)];
+            corpus += (rng() % 16 == 0) ? '\n' : ' ';
+        }
+        return corpus;
+    }
+
+    // Every generated word appears once, so the vocabulary size is exact
+    std::string makeVocabularyText(size_t vocabularySize) {
+        std::string text;
+        for (const auto& word : makeWords(vocabularySize, 42)) {
+            text += word;
+            text += ' ';
+        }
+        return text;
+    }
+
+    // Trained models are expensive at 1M words; build each size once per process
+    VectmoModel& modelWithVocabulary(size_t vocabularySize) {
+        static std::map<size_t, std::unique_ptr<VectmoModel>> models;
+        auto& model = models[vocabularySize];
+        if (!model) {
+            model = std::make_unique<VectmoModel>();
+            model->train(makeVocabularyText(vocabularySize) + makeCorpus(1 << 20, 2000, 7));
+            model->setSnapCacheCapacity(0);
+        }
+        return *model;
+    }
+
+    std::vector<std::string> makeQueries(size_t count) {
+        // Snap queries look like generated tokens: unseen letter soup
+        return makeWords(count, 1234);
+    }
+
+    void BM_BuildBigramTable(benchmark::State& state) {
+        std::string corpus = makeCorpus(static_cast<size_t>(state.range(0)), 5000, 1);
+        VectmoModel model;
+        for (auto _ : state) {
+            model.buildBigramTable(corpus);
+            benchmark::ClobberMemory();
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(corpus.size()));
+    }
+    BENCHMARK(BM_BuildBigramTable)->Arg(64 << 10)->Arg(1 << 20)->Arg(16 << 20)->Unit(benchmark::kMicrosecond);
+
+    void BM_Train(benchmark::State& state) {
+        std::string corpus = makeCorpus(static_cast<size_t>(state.range(0)), 20000, 2);
+        VectmoModel model;
+        for (auto _ : state) {
+            model.train(corpus);
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(corpus.size()));
+    }
+    BENCHMARK(BM_Train)->Arg(1 << 20)->Arg(16 << 20)->Unit(benchmark::kMillisecond);
+
+    void BM_CacheEmbeddings(benchmark::State& state) {
+        VectmoModel model;
+        model.train(makeVocabularyText(static_cast<size_t>(state.range(0))));
+        for (auto _ : state) {
+            model.cacheEmbeddings();
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    }
+    BENCHMARK(BM_CacheEmbeddings)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+    void BM_FindMostSimilarWord(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        auto queries = makeQueries(256);
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWord(queries[next]));
+            next = (next + 1) % queries.size();
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindMostSimilarWord)->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+    void BM_FindMostSimilarWordApproximate(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        model.setSimilarityIndex(std::make_unique<CharBucketIndex>(static_cast<int>(state.range(1))));
+        auto queries = makeQueries(256);
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWord(queries[next]));
+            next = (next + 1) % queries.size();
+        }
+        model.setSimilarityIndex(std::make_unique<ExactScanIndex>());
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindMostSimilarWordApproximate)
+        ->Args({100000, 1})->Args({100000, 2})->Args({1000000, 2})
+        ->Unit(benchmark::kMicrosecond);
+
+    void BM_FindMostSimilarWordPruned(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        model.setSimilarityIndex(std::make_unique<NormBoundIndex>());
+        auto queries = makeQueries(256);
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWord(queries[next]));
+            next = (next + 1) % queries.size();
+        }
+        model.setSimilarityIndex(std::make_unique<ExactScanIndex>());
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindMostSimilarWordPruned)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+    void BM_FindMostSimilarWordParallel(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        auto pool = std::make_shared<VectmoThreads::WorkStealingPool>(VectmoThreads::resolve(0) - 1);
+        model.setSimilarityIndex(std::make_unique<ExactScanIndex>(pool));
+        auto queries = makeQueries(256);
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWord(queries[next]));
+            next = (next + 1) % queries.size();
+        }
+        model.setSimilarityIndex(std::make_unique<ExactScanIndex>());
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindMostSimilarWordParallel)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+    void BM_FindMostSimilarWordCompact(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        model.setEmbeddingPrecision(EmbeddingPrecision::Uint8);
+        auto queries = makeQueries(256);
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWord(queries[next]));
+            next = (next + 1) % queries.size();
+        }
+        model.setEmbeddingPrecision(EmbeddingPrecision::Float32);
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindMostSimilarWordCompact)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+    void BM_FindMostSimilarWordsBatch(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(100000);
+        auto queries = makeQueries(static_cast<size_t>(state.range(0)));
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findMostSimilarWords(queries));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    }
+    BENCHMARK(BM_FindMostSimilarWordsBatch)->Arg(1)->Arg(16)->Arg(256)->Unit(benchmark::kMillisecond);
+
+    void BM_FindTopKSimilar(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(100000);
+        auto queries = makeQueries(256);
+        std::vector<VectmoModel::Neighbor> out(static_cast<size_t>(state.range(0)));
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(model.findTopKSimilar(queries[next], out));
+            next = (next + 1) % queries.size();
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FindTopKSimilar)->Arg(1)->Arg(10)->Arg(100)->Unit(benchmark::kMicrosecond);
+
+    void BM_FindTopKSimilarBatch(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(100000);
+        auto queries = makeQueries(static_cast<size_t>(state.range(0)));
+        std::vector<std::string_view> views(queries.begin(), queries.end());
+        size_t k = 10;
+        std::vector<VectmoModel::Neighbor> out(views.size() * k);
+        std::vector<size_t> counts(views.size());
+        for (auto _ : state) {
+            model.findTopKSimilarBatch(views, k, out, counts);
+            benchmark::DoNotOptimize(out.data());
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    }
+    BENCHMARK(BM_FindTopKSimilarBatch)->Arg(1)->Arg(16)->Arg(256)->Unit(benchmark::kMillisecond);
+
+    void BM_GenerateRawSequence(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(1000);
+        VectmoPredictor predictor(model);
+        int maxChars = static_cast<int>(state.range(0));
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(predictor.generateRawSequence('e', maxChars));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * maxChars);
+    }
+    BENCHMARK(BM_GenerateRawSequence)->Arg(50)->Arg(500)->Arg(5000)->Unit(benchmark::kMicrosecond);
+
+    void BM_GenerateSampledSequence(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(1000);
+        VectmoPredictor predictor(model);
+        VectmoRandom rng(42);
+        int maxChars = static_cast<int>(state.range(0));
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(predictor.generateSampledSequence('e', maxChars, rng));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * maxChars);
+    }
+    BENCHMARK(BM_GenerateSampledSequence)->Arg(50)->Arg(500)->Arg(5000)->Unit(benchmark::kMicrosecond);
+
+    void BM_BeamSearch(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(100000);
+        VectmoPredictor predictor(model);
+        int width = static_cast<int>(state.range(0));
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(predictor.beamSearch('e', 200, width));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * 200);
+    }
+    BENCHMARK(BM_BeamSearch)->Arg(1)->Arg(4)->Arg(16)->Unit(benchmark::kMicrosecond);
+
+    void BM_SnapToVocabulary(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(100000);
+        model.setSnapCacheCapacity(static_cast<size_t>(state.range(0)));
+        VectmoPredictor predictor(model);
+        std::string raw = predictor.generateRawSequence('e', 200);
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(predictor.snapToVocabulary(raw));
+        }
+        model.setSnapCacheCapacity(0);
+    }
+    BENCHMARK(BM_SnapToVocabulary)->Arg(0)->Arg(SnapCache::DEFAULT_CAPACITY)->Unit(benchmark::kMicrosecond);
+
+    void BM_SaveLoadText(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        const std::string base = "vectmo_bench_model";
+        VectmoModel loaded;
+        for (auto _ : state) {
+            model.save(base);
+            loaded.load(base);
+        }
+        std::remove((base + ".txt").c_str());
+        std::remove((base + ".words").c_str());
+    }
+    BENCHMARK(BM_SaveLoadText)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+    void BM_SaveLoadBinary(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        const std::string path = "vectmo_bench_model.vbin";
+        VectmoModel loaded;
+        for (auto _ : state) {
+            model.saveBinary(path);
+            loaded.loadBinary(path);
+        }
+        std::remove(path.c_str());
+    }
+    BENCHMARK(BM_SaveLoadBinary)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+    void BM_LoadBinary(benchmark::State& state) {
+        VectmoModel& model = modelWithVocabulary(static_cast<size_t>(state.range(0)));
+        const std::string path = "vectmo_bench_load.vbin";
+        model.saveBinary(path);
+        VectmoModel loaded;
+        for (auto _ : state) {
+            loaded.loadBinary(path);
+        }
+        std::remove(path.c_str());
+    }
+    BENCHMARK(BM_LoadBinary)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+}
+
+BENCHMARK_MAIN();
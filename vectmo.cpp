@@ -1,409 +1,7 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <array>
-#include <fstream>
-#include <map>
-#include <set>
-#include <algorithm>
-#include <cmath>
-#include <sstream>
-#include <numeric>
-#include <optional>
-
-namespace VectmoErrors {
-    const std::string FILE_NOT_CREATED_ERROR    = "FILE_NOT_CREATED_ERROR";
-    const std::string ERROR_ON_WRITING_TO_FILE  = "ERROR_ON_WRITING_TO_FILE";
-    const std::string ERROR_FILENAME_REQUIRED   = "ERROR_FILENAME_REQUIRED";
-}
-
-// Precompute character indices for O(1) lookup
-class CharIndexMap {
-private:
-    static constexpr std::array<char, 96> SUPPORTED_ASCII_CHARS = {
-        '!', '"', '#', '$', '%', '&', '\'', '(', ')', '*', '+', ',', '-', '.', '/',
-        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', ':', ';', '<', '=', '>', '?', '@',
-        'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q',
-        'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '[', '\\', ']', '^', '_', '`',
-        'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q',
-        'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', '{', '|', '}', '~', ' ', '\n'};
-
-    std::array<int, 256> lookupTable;
-
-public:
-    static constexpr int VOCAB_SIZE = 96;
-    static constexpr int INVALID_INDEX = -1;
-
-    CharIndexMap() {
-        lookupTable.fill(INVALID_INDEX);
-        for (int i = 0; i < VOCAB_SIZE; ++i) {
-            lookupTable[static_cast<unsigned char>(SUPPORTED_ASCII_CHARS[i])] = i;
-        }
-    }
-
-    int operator()(char c) const {
-        return lookupTable[static_cast<unsigned char>(c)];
-    }
-
-    char operator[](int index) const {
-        return (index >= 0 && index < VOCAB_SIZE) ? SUPPORTED_ASCII_CHARS[index] : '\0';
-    }
-
-    bool isSupported(char c) const {
-        return operator()(c) != INVALID_INDEX;
-    }
-};
-
-// Fixed-size vector for character histogram
-class CharHistogram {
-private:
-    std::array<double, CharIndexMap::VOCAB_SIZE> data{};
-
-public:
-    CharHistogram() = default;
-
-    explicit CharHistogram(const std::string& word, const CharIndexMap& charMap) {
-        for (char c : word) {
-            int idx = charMap(c);
-            if (idx != CharIndexMap::INVALID_INDEX) {
-                data[idx] += 1.0;
-            }
-        }
-    }
-
-    double dot(const CharHistogram& other) const {
-        return std::inner_product(data.begin(), data.end(), other.data.begin(), 0.0);
-    }
-
-    double magnitude() const {
-        double sum = std::accumulate(data.begin(), data.end(), 0.0, 
-            [](double acc, double val) { return acc + val * val; });
-        return std::sqrt(sum);
-    }
-
-    double cosineSimilarity(const CharHistogram& other) const {
-        double magA = magnitude();
-        double magB = other.magnitude();
-        
-        if (magA == 0.0 || magB == 0.0) return 0.0;
-        
-        return dot(other) / (magA * magB);
-    }
-
-    const auto& getData() const { return data; }
-};
-
-// Core model data
-class VectmoModel {
-private:
-    std::map<char, std::map<char, int>> bigramTable;
-    std::set<std::string> vocabulary;
-    std::map<std::string, CharHistogram> cachedEmbeddings;
-    CharIndexMap charMap;
-
-public:
-    void train(const std::string& text) {
-        buildBigramTable(text);
-        buildVocabulary(text);
-        cacheEmbeddings();
-    }
-
-    void buildBigramTable(const std::string& text) {
-        bigramTable.clear();
-        for (size_t i = 0; i + 1 < text.size(); ++i) {
-            if (charMap.isSupported(text[i]) && charMap.isSupported(text[i + 1])) {
-                bigramTable[text[i]][text[i + 1]]++;
-            }
-        }
-    }
-
-    void buildVocabulary(const std::string& text) {
-        vocabulary.clear();
-        std::istringstream stream(text);
-        std::string token;
-        while (stream >> token) {
-            if (!token.empty()) {
-                vocabulary.insert(token);
-            }
-        }
-    }
-
-    void cacheEmbeddings() {
-        cachedEmbeddings.clear();
-        for (const auto& word : vocabulary) {
-            cachedEmbeddings[word] = CharHistogram(word, charMap);
-        }
-    }
-
-    bool hasBigram(char c) const {
-        return bigramTable.find(c) != bigramTable.end() && !bigramTable.at(c).empty();
-    }
-
-    std::vector<char> getTopFollowers(char c, int maxCount = 0) const {
-        auto it = bigramTable.find(c);
-        if (it == bigramTable.end()) return {};
-
-        std::vector<std::pair<char, int>> followers(it->second.begin(), it->second.end());
-        std::sort(followers.begin(), followers.end(),
-                  [](const auto& a, const auto& b) { return a.second > b.second; });
-
-        std::vector<char> result;
-        for (const auto& [ch, count] : followers) {
-            result.push_back(ch);
-            if (maxCount > 0 && result.size() >= static_cast<size_t>(maxCount)) break;
-        }
-        return result;
-    }
-
-    std::optional<std::string> findMostSimilarWord(const std::string& word) const {
-        if (vocabulary.empty()) return std::nullopt;
-
-        CharHistogram wordHist(word, charMap);
-        
-        auto bestIt = vocabulary.begin();
-        double bestScore = -1.0;
-        
-        for (auto it = vocabulary.begin(); it != vocabulary.end(); ++it) {
-            auto cachedIt = cachedEmbeddings.find(*it);
-            if (cachedIt == cachedEmbeddings.end()) continue;
-            
-            double score = wordHist.cosineSimilarity(cachedIt->second);
-            
-            if (score > bestScore ||
-                (score == bestScore && 
-                 std::abs(static_cast<int>(it->size()) - static_cast<int>(word.size())) <
-                 std::abs(static_cast<int>(bestIt->size()) - static_cast<int>(word.size())))) {
-                bestScore = score;
-                bestIt = it;
-            }
-        }
-        
-        return *bestIt;
-    }
-
-    bool save(const std::string& basePath) const {
-        // Save bigram table
-        std::ofstream bigramFile(basePath + ".txt");
-        if (!bigramFile) return false;
-        
-        for (const auto& [from, followers] : bigramTable) {
-            int fromIdx = charMap(from);
-            if (fromIdx == CharIndexMap::INVALID_INDEX) continue;
-            
-            for (const auto& [to, count] : followers) {
-                int toIdx = charMap(to);
-                if (toIdx == CharIndexMap::INVALID_INDEX) continue;
-                bigramFile << fromIdx << ' ' << toIdx << ' ' << count << '\n';
-            }
-        }
-        
-        // Save vocabulary
-        std::ofstream vocabFile(basePath + ".words");
-        if (!vocabFile) return false;
-        
-        for (const auto& word : vocabulary) {
-            vocabFile << word << '\n';
-        }
-        
-        return true;
-    }
-
-    bool load(const std::string& basePath) {
-        // Load bigram table
-        std::ifstream bigramFile(basePath + ".txt");
-        if (!bigramFile) return false;
-        
-        bigramTable.clear();
-        int fromIdx, toIdx, count;
-        while (bigramFile >> fromIdx >> toIdx >> count) {
-            char from = charMap[fromIdx];
-            char to = charMap[toIdx];
-            if (from != '\0' && to != '\0') {
-                bigramTable[from][to] = count;
-            }
-        }
-        
-        // Load vocabulary
-        std::ifstream vocabFile(basePath + ".words");
-        if (!vocabFile) return false;
-        
-        vocabulary.clear();
-        std::string line;
-        while (std::getline(vocabFile, line)) {
-            if (!line.empty()) {
-                vocabulary.insert(line);
-            }
-        }
-        
-        // Rebuild cache
-        cacheEmbeddings();
-        
-        return true;
-    }
-
-    bool isTrained() const {
-        return !bigramTable.empty() && !vocabulary.empty();
-    }
-
-    const auto& getVocabulary() const { return vocabulary; }
-};
-
-// Prediction engine
-class VectmoPredictor {
-private:
-    const VectmoModel& model;
-    static constexpr int CYCLE_WINDOW_SIZE = 6;
-
-    static bool wouldCreateCycle(const std::string& sequence, char candidate) {
-        if (static_cast<int>(sequence.size()) < CYCLE_WINDOW_SIZE) return false;
-        
-        std::string newSeq = sequence + candidate;
-        std::string window = newSeq.substr(newSeq.size() - CYCLE_WINDOW_SIZE);
-        size_t earlierPos = newSeq.find(window);
-        size_t lastPos = newSeq.size() - CYCLE_WINDOW_SIZE;
-        
-        return earlierPos < lastPos;
-    }
-
-public:
-    explicit VectmoPredictor(const VectmoModel& m) : model(m) {}
-
-    std::string generateRawSequence(char seed, int maxChars) const {
-        std::string result(1, seed);
-        char current = seed;
-
-        for (int i = 0; i < maxChars; ++i) {
-            if (!model.hasBigram(current)) break;
-
-            auto followers = model.getTopFollowers(current);
-            char chosen = '\0';
-
-            for (char candidate : followers) {
-                if (!wouldCreateCycle(result, candidate)) {
-                    chosen = candidate;
-                    break;
-                }
-            }
-
-            if (chosen == '\0' && !followers.empty()) {
-                chosen = followers[0];  // forced move
-            }
-
-            if (chosen == '\0') break;
-
-            result += chosen;
-            current = chosen;
-        }
-
-        return result;
-    }
-
-    std::string snapToVocabulary(const std::string& rawSequence) const {
-        if (rawSequence.size() <= 1) return rawSequence;
-
-        std::vector<std::string> tokens;
-        std::string current;
-        
-        for (char c : rawSequence) {
-            if (c == ' ') {
-                tokens.push_back(current);
-                current.clear();
-            } else {
-                current += c;
-            }
-        }
-        tokens.push_back(current);
-
-        std::string result;
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (i > 0) result += ' ';
-            
-            if (tokens[i].empty()) continue;
-
-            auto bestWord = model.findMostSimilarWord(tokens[i]);
-            if (bestWord) {
-                result += *bestWord;
-            } else {
-                result += tokens[i];  // fallback
-            }
-        }
-
-        return result;
-    }
-};
+#include "vectmo.hpp"
 
-// Main API class (clean interface)
-class Vectmo {
-private:
-    VectmoModel model;
-    std::string workingFileBase;
-    bool modelLoaded = false;
-
-public:
-    bool setWorkingFile(const std::string& fileName) {
-        if (fileName.empty()) {
-            std::cerr << "[ERROR] " << VectmoErrors::ERROR_FILENAME_REQUIRED << '\n';
-            return false;
-        }
-        workingFileBase = fileName;
-        return true;
-    }
-
-    bool createFile() {
-        if (workingFileBase.empty()) {
-            std::cerr << "[ERROR] " << VectmoErrors::ERROR_FILENAME_REQUIRED << '\n';
-            return false;
-        }
-
-        std::ofstream file(workingFileBase + ".txt", std::ios::trunc);
-        if (!file) {
-            std::cerr << "[ERROR] " << VectmoErrors::FILE_NOT_CREATED_ERROR << '\n';
-            return false;
-        }
-        return true;
-    }
-
-    bool pretrainModel(const std::string& trainingText) {
-        if (workingFileBase.empty()) {
-            std::cerr << "[PRETRAIN] ERROR: No file set. Call setWorkingFile() first.\n";
-            return false;
-        }
-
-        model.train(trainingText);
-        
-        if (!model.save(workingFileBase)) {
-            std::cerr << "[PRETRAIN] ERROR: Failed to save model\n";
-            return false;
-        }
-
-        modelLoaded = true;
-        std::cout << "[PRETRAIN] Model trained and saved successfully\n";
-        return true;
-    }
-
-    std::string predictNextText(const std::string& inputText, int maxChars = 50) {
-        if (inputText.empty()) return "[No input provided]";
-
-        if (!modelLoaded) {
-            if (!model.load(workingFileBase)) {
-                return "[Model not trained yet or file not found]";
-            }
-            modelLoaded = true;
-        }
-
-        char seed = inputText.back();
-        
-        VectmoPredictor predictor(model);
-        std::string rawSequence = predictor.generateRawSequence(seed, maxChars);
-        
-        if (rawSequence.size() <= 1) return "[No continuation found]";
-        
-        std::string rawOutput = rawSequence.substr(1);  // remove seed
-        std::string snapped = predictor.snapToVocabulary(rawOutput);
-        
-        return snapped;
-    }
-};
+#include <cstdlib>
+#include <csignal>
 
 // Clean UI separation
 class VectmoUI {
@@ -414,10 +12,19 @@ private:
         std::cout << "\n==== Vectmo: Text Vectorization & Prediction ====\n\n";
     }
 
-    void printPredictionBox(const std::string& input, const std::string& output) const {
+    // Words are printed as they are generated so the first one shows up right away
+    void printPredictionBox(const std::string& input) {
         std::cout << "\n┌─ PREDICTION ─────────────────────────┐\n";
         std::cout << "│ Input:  \"" << input << "\"\n";
-        std::cout << "│ Output: \"" << output << "\"\n";
+        std::cout << "│ Output: \"" << std::flush;
+        bool first = true;
+        vectmo.predictNextTextStream(input, [&first](std::string_view word) {
+            if (!first) std::cout << ' ';
+            first = false;
+            std::cout << word << std::flush;
+            return true;
+        });
+        std::cout << "\"\n";
         std::cout << "└───────────────────────────────────────┘\n";
     }
 
@@ -471,8 +78,7 @@ public:
                 continue;
             }
 
-            std::string prediction = vectmo.predictNextText(input);
-            printPredictionBox(input, prediction);
+            printPredictionBox(input);
 
             std::cout << "\nContinue? (Y/y/N/n): ";
             char choice;
@@ -487,7 +93,412 @@ public:
     }
 };
 
-int main() {
+// Non-interactive front end: one prompt per input line, one prediction per output line
+class VectmoBatchCLI {
+private:
+    static constexpr size_t BATCH_LINES = 1024;
+
+    Vectmo vectmo;
+    std::string modelBase;
+    std::string corpusPath;
+    std::string promptsPath = "-";
+    int maxChars = 50;
+    unsigned threads = 1;
+    unsigned searchThreads = 1;
+    std::shared_ptr<VectmoThreads::WorkStealingPool> searchPool;
+    int order = NgramModel::MIN_ORDER;
+    bool compact = false;
+    bool lazyEmbeddings = false;
+    std::string metricsPath;
+    std::optional<SamplingOptions> sampling;
+    uint64_t seed = 0;
+    int candidates = 1;
+    int beamWidth = 0;
+    bool checkBeam = false;
+    bool stream = false;
+    std::string serveAddress;
+    int batchSize = 64;
+    int batchWaitMicros = 1000;
+    int deadlineMillis = 0;
+    int queueCapacity = 4096;
+    unsigned serverThreads = 1;
+    int saveShardCount = 0;
+    bool snapShard = false;
+    std::string shardAddresses;
+    int hedgeMillis = 20;
+    size_t linesAnswered = 0;
+    size_t unsnappedLines = 0;
+
+    static void printUsage(std::ostream& out) {
+        out << "Usage: vectmo                         interactive mode\n"
+               "       vectmo --model BASE [options]  batch mode\n"
+               "\n"
+               "Options:\n"
+               "  --model BASE      model file base (BASE.vbin, or BASE.txt + BASE.words)\n"
+               "  --train FILE      train BASE from FILE before predicting\n"
+               "  --prompts FILE    newline-delimited prompts (default: stdin)\n"
+               "  --max-chars N     characters generated per prompt (default: 50)\n"
+               "  --threads N       training threads, 0 = all cores (default: 1)\n"
+               "  --search-threads N  threads per snap on large vocabularies, 0 = all cores (default: 1)\n"
+               "  --order N         context order used by --train, 2-6 (default: 2)\n"
+               "  --compact         store embeddings as uint8 counts (4x smaller rows)\n"
+               "  --lazy-embeddings build embeddings from BASE.words in the background and on\n"
+               "                    first use instead of before the first prompt\n"
+               "  --temperature T   sample continuations instead of greedy decoding (default: 1)\n"
+               "  --top-k K         sample from the K most frequent followers only\n"
+               "  --top-p P         sample from the followers holding mass P only\n"
+               "  --seed S          sampling seed (default: 0)\n"
+               "  --candidates N    sample N continuations, print the most likely (default: 1)\n"
+               "  --beam N          beam-search N paths that spell vocabulary words directly\n"
+               "  --check-beam      with --beam, check every seed char continues wherever greedy\n"
+               "                    decoding does, then exit (1 if one does not)\n"
+               "  --stream          print each word as soon as it is generated\n"
+               "  --serve ADDR      answer prompt lines on a socket instead of stdin:\n"
+               "                    unix:PATH, PORT (loopback) or HOST:PORT\n"
+               "  --batch-size N    prompts per served micro-batch (default: 64)\n"
+               "  --batch-wait-us N longest a served prompt waits for its batch to fill (default: 1000)\n"
+               "  --deadline-ms N   default per-request deadline when serving, 0 = none (default: 0)\n"
+               "  --queue N         served prompts queued before reads pause (default: 4096)\n"
+               "  --server-threads N  threads running served batches (default: 1)\n"
+               "  --save-shards N   split the vocabulary of BASE into BASE.shard<i>.vbin, i < N\n"
+               "  --snap-shard      with --serve, answer snap queries for this (shard) model\n"
+               "  --shards LIST     snap against shard servers: shards separated by ',',\n"
+               "                    replicas of one shard by '|'\n"
+               "  --hedge-ms N      ask a shard's next replica after N ms without an answer (default: 20)\n"
+               "  --metrics FILE    write Prometheus metrics to FILE after the run\n"
+               "                    (needs a build with -DVECTMO_METRICS=1)\n";
+    }
+
+    // Predictions must stay on one line for line-oriented consumers
+    static void writeLine(const std::string& text) {
+        std::string line = text;
+        std::replace(line.begin(), line.end(), '\n', ' ');
+        std::replace(line.begin(), line.end(), '\r', ' ');
+        std::cout << line << '\n';
+    }
+
+    // A shard that could not be reached leaves raw tokens in the line; say so
+    // instead of passing them off as a prediction
+    void noteAnswer(bool incomplete) {
+        ++linesAnswered;
+        if (!incomplete) return;
+        ++unsnappedLines;
+        std::cerr << "[WARNING] Line " << linesAnswered
+                  << ": vocabulary unreachable, some tokens were left unsnapped\n";
+    }
+
+    // One prompt at a time, flushing every word so a reader sees it immediately
+    void streamLine(const std::string& prompt) {
+        bool first = true;
+        bool incomplete = false;
+        vectmo.predictNextTextStream(prompt, [&first](std::string_view word) {
+            std::string piece(word);
+            std::replace(piece.begin(), piece.end(), '\n', ' ');
+            std::replace(piece.begin(), piece.end(), '\r', ' ');
+            if (!first) std::cout << ' ';
+            first = false;
+            std::cout << piece << std::flush;
+            return static_cast<bool>(std::cout);
+        }, maxChars, &incomplete);
+        std::cout << '\n' << std::flush;
+        noteAnswer(incomplete);
+    }
+
+    void flushBatch(std::vector<std::string>& prompts) {
+        std::vector<bool> incomplete;
+        auto predictions = vectmo.predictNextTextBatch(prompts, maxChars, &incomplete);
+        for (size_t i = 0; i < predictions.size(); ++i) {
+            writeLine(predictions[i]);
+            noteAnswer(incomplete[i]);
+        }
+        prompts.clear();
+    }
+
+public:
+    // Returns false (after printing usage) if the arguments are unusable
+    bool parse(int argc, char** argv) {
+        // Any sampling option switches decoding from greedy to sampled
+        auto samplingOptions = [&]() -> SamplingOptions& {
+            if (!sampling) sampling.emplace();
+            return *sampling;
+        };
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--help" || arg == "-h") {
+                printUsage(std::cout);
+                return false;
+            } else if (arg == "--model" && hasValue) {
+                modelBase = argv[++i];
+            } else if (arg == "--train" && hasValue) {
+                corpusPath = argv[++i];
+            } else if (arg == "--prompts" && hasValue) {
+                promptsPath = argv[++i];
+            } else if (arg == "--max-chars" && hasValue) {
+                maxChars = std::atoi(argv[++i]);
+            } else if (arg == "--threads" && hasValue) {
+                threads = static_cast<unsigned>(std::atoi(argv[++i]));
+            } else if (arg == "--search-threads" && hasValue) {
+                searchThreads = static_cast<unsigned>(std::atoi(argv[++i]));
+            } else if (arg == "--order" && hasValue) {
+                order = std::atoi(argv[++i]);
+            } else if (arg == "--compact") {
+                compact = true;
+            } else if (arg == "--lazy-embeddings") {
+                lazyEmbeddings = true;
+            } else if (arg == "--temperature" && hasValue) {
+                samplingOptions().temperature = std::atof(argv[++i]);
+            } else if (arg == "--top-k" && hasValue) {
+                samplingOptions().topK = std::atoi(argv[++i]);
+            } else if (arg == "--top-p" && hasValue) {
+                samplingOptions().topP = std::atof(argv[++i]);
+            } else if (arg == "--seed" && hasValue) {
+                seed = std::strtoull(argv[++i], nullptr, 10);
+                samplingOptions();
+            } else if (arg == "--candidates" && hasValue) {
+                candidates = std::atoi(argv[++i]);
+                samplingOptions();
+            } else if (arg == "--beam" && hasValue) {
+                beamWidth = std::atoi(argv[++i]);
+            } else if (arg == "--check-beam") {
+                checkBeam = true;
+            } else if (arg == "--stream") {
+                stream = true;
+            } else if (arg == "--serve" && hasValue) {
+                serveAddress = argv[++i];
+            } else if (arg == "--batch-size" && hasValue) {
+                batchSize = std::max(std::atoi(argv[++i]), 1);
+            } else if (arg == "--batch-wait-us" && hasValue) {
+                batchWaitMicros = std::max(std::atoi(argv[++i]), 0);
+            } else if (arg == "--deadline-ms" && hasValue) {
+                deadlineMillis = std::max(std::atoi(argv[++i]), 0);
+            } else if (arg == "--queue" && hasValue) {
+                queueCapacity = std::max(std::atoi(argv[++i]), 1);
+            } else if (arg == "--server-threads" && hasValue) {
+                serverThreads = static_cast<unsigned>(std::atoi(argv[++i]));
+            } else if (arg == "--save-shards" && hasValue) {
+                saveShardCount = std::max(std::atoi(argv[++i]), 1);
+            } else if (arg == "--snap-shard") {
+                snapShard = true;
+            } else if (arg == "--shards" && hasValue) {
+                shardAddresses = argv[++i];
+            } else if (arg == "--hedge-ms" && hasValue) {
+                hedgeMillis = std::max(std::atoi(argv[++i]), 0);
+            } else if (arg == "--metrics" && hasValue) {
+                metricsPath = argv[++i];
+            } else {
+                std::cerr << "[ERROR] Unknown or incomplete option: " << arg << "\n";
+                printUsage(std::cerr);
+                return false;
+            }
+        }
+        if (modelBase.empty()) {
+            std::cerr << "[ERROR] " << VectmoErrors::ERROR_FILENAME_REQUIRED << '\n';
+            printUsage(std::cerr);
+            return false;
+        }
+        if (!shardAddresses.empty() && beamWidth > 0) {
+            std::cerr << "[ERROR] --beam spells from the local vocabulary and cannot use --shards\n";
+            return false;
+        }
+        if (checkBeam && beamWidth <= 0) {
+            std::cerr << "[ERROR] --check-beam needs --beam\n";
+            return false;
+        }
+        if (snapShard && serveAddress.empty()) {
+            std::cerr << "[ERROR] --snap-shard needs --serve\n";
+            return false;
+        }
+        return true;
+    }
+
+    int run() {
+        vectmo.setLogStream(std::cerr);
+        vectmo.setTrainingThreads(threads);
+        vectmo.setContextOrder(order);
+        vectmo.setEmbeddingPrecision(compact ? EmbeddingPrecision::Uint8 : EmbeddingPrecision::Float32);
+        if (lazyEmbeddings) vectmo.setEmbeddingBuild(EmbeddingStore::RowBuild::Background);
+        vectmo.setSampling(sampling, seed, candidates);
+        vectmo.setBeamWidth(beamWidth);
+        if (!metricsPath.empty()) {
+            if (!VectmoMetrics::COMPILED_IN) {
+                std::cerr << "[ERROR] --metrics needs a build with -DVECTMO_METRICS=1\n";
+                return 1;
+            }
+            VectmoMetrics::setEnabled(true);
+        }
+        if (!vectmo.setWorkingFile(modelBase)) return 1;
+        unsigned searchWorkers = VectmoThreads::resolve(searchThreads) - 1;
+        if (searchWorkers > 0) {
+            searchPool = std::make_shared<VectmoThreads::WorkStealingPool>(searchWorkers);
+            vectmo.setSimilarityIndexFactory([pool = searchPool] { return std::make_unique<ExactScanIndex>(pool); });
+        }
+        if (!shardAddresses.empty() && !useShards()) return 1;
+
+        if (!corpusPath.empty()) {
+            if (!vectmo.pretrainModelFromFile(corpusPath)) return 1;
+        } else if (!vectmo.loadModel()) {
+            std::cerr << "[ERROR] Model not trained yet or file not found: " << modelBase << '\n';
+            return 1;
+        }
+
+        if (saveShardCount > 0) {
+            auto model = vectmo.snapshot();
+            if (!model || !model->saveShards(modelBase, static_cast<uint32_t>(saveShardCount))) return 1;
+            std::cerr << "[PRETRAIN] Wrote " << saveShardCount << " shards of " << modelBase << '\n';
+            return 0;
+        }
+
+        if (checkBeam) return checkBeamAgainstGreedy() ? 0 : 1;
+
+        if (!serveAddress.empty()) {
+            if (!serve()) return 1;
+            return writeMetrics() ? 0 : 1;
+        }
+
+        std::ifstream file;
+        if (promptsPath != "-") {
+            file.open(promptsPath);
+            if (!file) {
+                std::cerr << "[ERROR] Cannot open prompts file: " << promptsPath << '\n';
+                return 1;
+            }
+        }
+        std::istream& in = promptsPath == "-" ? std::cin : file;
+
+        std::vector<std::string> prompts;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (stream) {
+                streamLine(line);
+                continue;
+            }
+            prompts.push_back(line);
+            if (prompts.size() >= BATCH_LINES) flushBatch(prompts);
+        }
+        flushBatch(prompts);
+        std::cout.flush();
+        if (unsnappedLines > 0) {
+            std::cerr << "[ERROR] " << unsnappedLines << " of " << linesAnswered
+                      << " predictions were left partly unsnapped\n";
+        }
+        return writeMetrics() && unsnappedLines == 0 ? 0 : 1;
+    }
+
+private:
+#ifdef VECTMO_HAS_SOCKETS
+    static inline VectmoServer* activeServer = nullptr;
+
+    static void onStopSignal(int) {
+        if (activeServer) activeServer->stop();
+    }
+
+    // Runs until SIGINT or SIGTERM; a second signal skips draining in-flight requests
+    bool serve() {
+        VectmoServer::Options options;
+        options.batching.maxBatch = static_cast<size_t>(batchSize);
+        options.batching.maxWait = std::chrono::microseconds(batchWaitMicros);
+        options.batching.capacity = static_cast<size_t>(queueCapacity);
+        options.batching.workers = VectmoThreads::resolve(serverThreads);
+        options.batching.maxChars = maxChars;
+        options.defaultDeadline = std::chrono::milliseconds(deadlineMillis);
+        // A shard server answers snap queries against whichever model is current
+        auto server = snapShard
+            ? VectmoServer([this](std::span<const std::string> lines) {
+                  return VectmoWire::answerSnapQueries(*vectmo.snapshot(), lines);
+              }, options)
+            : VectmoServer(vectmo, options);
+        if (!server.listen(serveAddress)) return false;
+        std::cerr << "[SERVER] Listening on " << serveAddress;
+        if (server.port() != 0) std::cerr << " (port " << server.port() << ")";
+        std::cerr << '\n';
+
+        activeServer = &server;
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGINT, onStopSignal);
+        std::signal(SIGTERM, onStopSignal);
+        bool ok = server.run();
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        activeServer = nullptr;
+        std::cerr << "[SERVER] Stopped\n";
+        return ok;
+    }
+
+    // "a1|a2,b1" is shard a on two replicas and shard b on one
+    bool useShards() {
+        std::vector<std::vector<std::string>> shards;
+        std::stringstream list(shardAddresses);
+        for (std::string shard; std::getline(list, shard, ',');) {
+            std::vector<std::string> replicas;
+            std::stringstream replicaList(shard);
+            for (std::string address; std::getline(replicaList, address, '|');) {
+                if (!address.empty()) replicas.push_back(address);
+            }
+            if (replicas.empty()) {
+                std::cerr << "[ERROR] Empty shard in --shards " << shardAddresses << '\n';
+                return false;
+            }
+            shards.push_back(std::move(replicas));
+        }
+        VectmoShardClient::Options options;
+        options.hedgeDelay = std::chrono::milliseconds(hedgeMillis);
+        std::signal(SIGPIPE, SIG_IGN);
+        vectmo.setRemoteVocabulary(std::make_shared<VectmoShardClient>(std::move(shards), options));
+        return true;
+    }
+#else
+    bool serve() {
+        std::cerr << "[ERROR] --serve needs a platform with POSIX sockets\n";
+        return false;
+    }
+
+    bool useShards() {
+        std::cerr << "[ERROR] --shards needs a platform with POSIX sockets\n";
+        return false;
+    }
+#endif
+
+    // Beam search may phrase a continuation differently, but it must not find
+    // none where greedy decoding finds one
+    bool checkBeamAgainstGreedy() {
+        static const std::string NO_CONTINUATION = "[No continuation found]";
+        int failures = 0;
+        for (int c = 1; c < 256; ++c) {
+            std::string prompt(1, static_cast<char>(c));
+            vectmo.setBeamWidth(0);
+            vectmo.setSampling(std::nullopt);
+            std::string greedy = vectmo.predictNextText(prompt, maxChars);
+            vectmo.setBeamWidth(beamWidth);
+            if (greedy == NO_CONTINUATION || vectmo.predictNextText(prompt, maxChars) != NO_CONTINUATION) continue;
+            std::cerr << "[CHECK] --beam " << beamWidth << " found no continuation after byte " << c
+                      << " where greedy decoding gives \"" << greedy << "\"\n";
+            ++failures;
+        }
+        std::cerr << "[CHECK] --beam " << beamWidth << ": " << failures << " seed(s) without a continuation\n";
+        return failures == 0;
+    }
+
+    bool writeMetrics() const {
+        if (metricsPath.empty()) return true;
+        std::ofstream metrics(metricsPath, std::ios::trunc);
+        metrics << VectmoMetrics::snapshot().toPrometheus();
+        if (!metrics) {
+            std::cerr << "[ERROR] Cannot write metrics file: " << metricsPath << '\n';
+            return false;
+        }
+        return true;
+    }
+};
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        VectmoBatchCLI cli;
+        if (!cli.parse(argc, argv)) return 2;
+        return cli.run();
+    }
+
     VectmoUI ui;
     ui.run();
     return 0;
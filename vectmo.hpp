@@ -0,0 +1,5945 @@
+// Vectmo library: character bigram model, histogram embeddings and snapping.
+// Header-only; vectmo.cpp is the interactive and batch front end.
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+#include <map>
+#include <tuple>
+#include <bit>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <condition_variable>
+#include <string_view>
+#include <cstring>
+#include <chrono>
+#include <cstdlib>
+#include <memory_resource>
+#include <charconv>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define VECTMO_HAS_MMAP 1
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#define VECTMO_HAS_SOCKETS 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace VectmoErrors {
+    inline const std::string FILE_NOT_CREATED_ERROR    = "FILE_NOT_CREATED_ERROR";
+    inline const std::string ERROR_ON_WRITING_TO_FILE  = "ERROR_ON_WRITING_TO_FILE";
+    inline const std::string ERROR_FILENAME_REQUIRED   = "ERROR_FILENAME_REQUIRED";
+}
+
+// Fork-join helpers for the data-parallel parts of training
+namespace VectmoThreads {
+    // 0 means "all hardware threads"
+    inline unsigned resolve(unsigned threadCount) {
+        if (threadCount > 0) return threadCount;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Runs fn(0..shards-1), one shard per thread; shard 0 runs on the caller
+    template <typename Fn>
+    void runShards(unsigned shards, Fn&& fn) {
+        std::vector<std::thread> workers;
+        workers.reserve(shards > 0 ? shards - 1 : 0);
+        for (unsigned t = 1; t < shards; ++t) workers.emplace_back(fn, t);
+        if (shards > 0) fn(0u);
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Persistent pool for latency-sensitive fan-out: each worker owns a deque,
+    // pops its own newest task and steals the oldest from the others when idle.
+    // Callers of parallelFor() run tasks too, so a pool with no workers is serial.
+    class WorkStealingPool {
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::mutex sleepMutex;
+        std::condition_variable wake;
+        std::atomic<size_t> pending{0};
+        std::atomic<size_t> nextQueue{0};
+        bool stopping = false;
+
+        bool popLocal(size_t q, std::function<void()>& task) {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            if (queues[q]->tasks.empty()) return false;
+            task = std::move(queues[q]->tasks.back());
+            queues[q]->tasks.pop_back();
+            return true;
+        }
+
+        bool steal(size_t thief, std::function<void()>& task) {
+            for (size_t k = 1; k <= queues.size(); ++k) {
+                size_t victim = (thief + k) % queues.size();
+                std::lock_guard<std::mutex> lock(queues[victim]->mutex);
+                if (queues[victim]->tasks.empty()) continue;
+                task = std::move(queues[victim]->tasks.front());
+                queues[victim]->tasks.pop_front();
+                return true;
+            }
+            return false;
+        }
+
+        bool take(size_t q, std::function<void()>& task) {
+            if (!popLocal(q, task) && !steal(q, task)) return false;
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        void run(size_t q) {
+            std::function<void()> task;
+            for (;;) {
+                if (take(q, task)) {
+                    task();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                wake.wait(lock, [&] { return stopping || pending.load(std::memory_order_relaxed) > 0; });
+                if (stopping && pending.load(std::memory_order_relaxed) == 0) return;
+            }
+        }
+
+        void submit(std::function<void()> task) {
+            // Counted before it is visible, so take() can never drive pending below zero
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                pending.fetch_add(1, std::memory_order_relaxed);
+            }
+            size_t q = nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+            {
+                std::lock_guard<std::mutex> lock(queues[q]->mutex);
+                queues[q]->tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+    public:
+        // workerCount threads in addition to the callers; 0 runs everything inline
+        explicit WorkStealingPool(unsigned workerCount) {
+            for (unsigned i = 0; i < std::max(workerCount, 1u); ++i) queues.push_back(std::make_unique<Queue>());
+            for (unsigned i = 0; i < workerCount; ++i) workers.emplace_back([this, i] { run(i); });
+        }
+
+        ~WorkStealingPool() {
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) worker.join();
+        }
+
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        size_t workerCount() const { return workers.size(); }
+
+        // Runs fn(0..count-1) and returns once all have finished. The caller runs
+        // task 0 and then helps with whatever is queued instead of blocking.
+        template <typename Fn>
+        void parallelFor(size_t count, Fn&& fn) {
+            if (count == 0) return;
+            if (workers.empty() || count == 1) {
+                for (size_t i = 0; i < count; ++i) fn(i);
+                return;
+            }
+
+            std::atomic<size_t> remaining{count - 1};
+            std::mutex doneMutex;
+            std::condition_variable done;
+            for (size_t i = 1; i < count; ++i) {
+                submit([&, i] {
+                    fn(i);
+                    // Decrement under the lock: once the caller holds it and sees
+                    // zero, no task touches this frame again
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) done.notify_one();
+                });
+            }
+            fn(0);
+
+            std::function<void()> task;
+            size_t home = nextQueue.load(std::memory_order_relaxed) % queues.size();
+            while (remaining.load(std::memory_order_acquire) > 0) {
+                if (take(home, task)) {
+                    task();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(doneMutex);
+                done.wait(lock, [&] { return remaining.load(std::memory_order_acquire) == 0; });
+            }
+            std::lock_guard<std::mutex> lock(doneMutex);
+        }
+    };
+}
+
+// Hot-path instrumentation. Recording compiles to nothing unless the build defines
+// VECTMO_METRICS=1; when compiled in it can be toggled at runtime and starts on if
+// the VECTMO_METRICS environment variable is set to a non-zero value. Each thread
+// accumulates into its own slots, so recording never contends; snapshot() sums
+// live threads plus those that have already exited.
+#ifndef VECTMO_METRICS
+#define VECTMO_METRICS 0
+#endif
+
+namespace VectmoMetrics {
+    constexpr bool COMPILED_IN = VECTMO_METRICS != 0;
+
+    // Snap covers a whole snapToVocabulary call, including its cache lookups and
+    // index searches; Tokenize is the split-and-dedupe phase of batch snapping
+    enum class Stage { Generate, Tokenize, Snap, Search, CacheLookup, Count };
+    enum class Counter {
+        Predictions, ForcedMoves, CycleRejections, SnapQueries, CacheHits, CacheMisses, CandidatesScored,
+        ScheduledBatches, DeadlineMisses, HedgedRequests, ShardFailures, Count
+    };
+
+    constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::Count);
+    constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+
+    inline constexpr std::array<const char*, STAGE_COUNT> STAGE_NAMES = {
+        "generate", "tokenize", "snap", "search", "cache_lookup"};
+    inline constexpr std::array<const char*, COUNTER_COUNT> COUNTER_NAMES = {
+        "predictions", "forced_moves", "cycle_rejections", "snap_queries",
+        "cache_hits", "cache_misses", "candidates_scored", "scheduled_batches", "deadline_misses",
+        "hedged_requests", "shard_failures"};
+    inline constexpr std::array<const char*, COUNTER_COUNT> COUNTER_HELP = {
+        "Prompts answered by predictNextText and predictNextTextBatch.",
+        "Generation steps where every follower closed a cycle.",
+        "Followers skipped because they would repeat a recent window.",
+        "Tokens submitted for snapping.",
+        "Snaps answered by the snap cache.",
+        "Snaps that missed the snap cache.",
+        "Embedding rows scored by similarity searches.",
+        "Micro-batches run by VectmoBatchScheduler.",
+        "Scheduled prompts dropped because their deadline passed first.",
+        "Shard snap batches also sent to a second replica.",
+        "Shard snap batches left unanswered because a shard was unreachable."};
+
+    struct Snapshot {
+        std::array<uint64_t, STAGE_COUNT> stageNanos{};
+        std::array<uint64_t, STAGE_COUNT> stageCalls{};
+        std::array<uint64_t, COUNTER_COUNT> counters{};
+
+        uint64_t operator[](Counter c) const { return counters[static_cast<size_t>(c)]; }
+
+        // Prometheus text exposition format
+        std::string toPrometheus() const {
+            std::ostringstream out;
+            out << "# HELP vectmo_stage_seconds_total Wall time spent in each prediction stage.\n"
+                << "# TYPE vectmo_stage_seconds_total counter\n";
+            for (size_t i = 0; i < STAGE_COUNT; ++i) {
+                out << "vectmo_stage_seconds_total{stage=\"" << STAGE_NAMES[i] << "\"} "
+                    << static_cast<double>(stageNanos[i]) * 1e-9 << '\n';
+            }
+            out << "# HELP vectmo_stage_calls_total Times each prediction stage ran.\n"
+                << "# TYPE vectmo_stage_calls_total counter\n";
+            for (size_t i = 0; i < STAGE_COUNT; ++i) {
+                out << "vectmo_stage_calls_total{stage=\"" << STAGE_NAMES[i] << "\"} " << stageCalls[i] << '\n';
+            }
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+                out << "# HELP vectmo_" << COUNTER_NAMES[i] << "_total " << COUNTER_HELP[i] << '\n'
+                    << "# TYPE vectmo_" << COUNTER_NAMES[i] << "_total counter\n"
+                    << "vectmo_" << COUNTER_NAMES[i] << "_total " << counters[i] << '\n';
+            }
+            return out.str();
+        }
+    };
+
+    inline std::atomic<bool>& enabledFlag() {
+        static std::atomic<bool> flag{[] {
+            const char* env = std::getenv("VECTMO_METRICS");
+            return env != nullptr && std::atoi(env) != 0;
+        }()};
+        return flag;
+    }
+
+    inline bool enabled() { return COMPILED_IN && enabledFlag().load(std::memory_order_relaxed); }
+    inline void setEnabled(bool on) { enabledFlag().store(on, std::memory_order_relaxed); }
+
+    // One per thread; only the owner writes, so relaxed load + store is enough and
+    // snapshot() can read concurrently without a data race
+    struct Accumulator {
+        std::array<std::atomic<uint64_t>, STAGE_COUNT> stageNanos{};
+        std::array<std::atomic<uint64_t>, STAGE_COUNT> stageCalls{};
+        std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters{};
+
+        Accumulator();
+        ~Accumulator();
+
+        static void bump(std::atomic<uint64_t>& slot, uint64_t n) {
+            slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        void addTo(Snapshot& total) const {
+            for (size_t i = 0; i < STAGE_COUNT; ++i) {
+                total.stageNanos[i] += stageNanos[i].load(std::memory_order_relaxed);
+                total.stageCalls[i] += stageCalls[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) total.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<const Accumulator*> live;
+        Snapshot retired;  // totals of threads that have exited
+    };
+
+    inline Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    inline Accumulator::Accumulator() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.push_back(this);
+    }
+
+    inline Accumulator::~Accumulator() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        addTo(r.retired);
+        r.live.erase(std::remove(r.live.begin(), r.live.end(), this), r.live.end());
+    }
+
+    inline Accumulator& local() {
+        thread_local Accumulator accumulator;
+        return accumulator;
+    }
+
+    inline void add(Counter c, uint64_t n = 1) {
+        if (enabled()) Accumulator::bump(local().counters[static_cast<size_t>(c)], n);
+    }
+
+    inline void record(Stage stage, uint64_t nanos) {
+        Accumulator& acc = local();
+        Accumulator::bump(acc.stageNanos[static_cast<size_t>(stage)], nanos);
+        Accumulator::bump(acc.stageCalls[static_cast<size_t>(stage)], 1);
+    }
+
+    inline Snapshot snapshot() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        Snapshot total = r.retired;
+        for (const Accumulator* acc : r.live) acc->addTo(total);
+        return total;
+    }
+
+    // Times its scope into one stage; reads the clock only while metrics are enabled
+    class ScopedTimer {
+    private:
+        Stage stage;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit ScopedTimer(Stage s) : stage(s), active(enabled()) {
+            if (active) start = std::chrono::steady_clock::now();
+        }
+        ~ScopedTimer() {
+            if (!active) return;
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            record(stage, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    };
+}
+
+#define VECTMO_METRICS_CONCAT_(a, b) a##b
+#define VECTMO_METRICS_CONCAT(a, b) VECTMO_METRICS_CONCAT_(a, b)
+#if VECTMO_METRICS
+#define VECTMO_METRICS_TIME(stage) \
+    VectmoMetrics::ScopedTimer VECTMO_METRICS_CONCAT(vectmoTimer, __LINE__)(VectmoMetrics::Stage::stage)
+#define VECTMO_METRICS_COUNT(counter, n) VectmoMetrics::add(VectmoMetrics::Counter::counter, (n))
+#else
+#define VECTMO_METRICS_TIME(stage) ((void)0)
+#define VECTMO_METRICS_COUNT(counter, n) ((void)0)
+#endif
+
+// Alphabets a build can model. A policy lists its symbols in index order and
+// may fold other bytes onto them; '\0' is never a symbol, generation uses it as
+// "no character". Pick one with -DVECTMO_ALPHABET=<name> (default Printable).
+namespace VectmoAlphabet {
+    // Printable ASCII plus space and newline
+    struct Printable {
+        static constexpr std::array<char, 96> SYMBOLS = {
+            '!', '"', '#', '$', '%', '&', '\'', '(', ')', '*', '+', ',', '-', '.', '/',
+            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', ':', ';', '<', '=', '>', '?', '@',
+            'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q',
+            'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '[', '\\', ']', '^', '_', '`',
+            'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q',
+            'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', '{', '|', '}', '~', ' ', '\n'};
+        static constexpr unsigned char fold(unsigned char c) { return c; }
+    };
+
+    // Letters, space and newline; upper case folds onto lower case, so rows fit
+    // in 32 lanes instead of 96
+    struct Lowercase {
+        static constexpr std::array<char, 28> SYMBOLS = {
+            'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q',
+            'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', ' ', '\n'};
+        static constexpr unsigned char fold(unsigned char c) {
+            return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c - 'A' + 'a') : c;
+        }
+    };
+
+    // Every byte but '\0', for UTF-8 or binary-ish corpora
+    struct Bytes {
+        static constexpr std::array<char, 255> SYMBOLS = [] {
+            std::array<char, 255> symbols{};
+            for (int i = 0; i < 255; ++i) symbols[i] = static_cast<char>(i + 1);
+            return symbols;
+        }();
+        static constexpr unsigned char fold(unsigned char c) { return c; }
+    };
+}
+
+// Character indices for O(1) lookup; the table is generated at compile time
+template <typename Alphabet>
+class BasicCharIndexMap {
+public:
+    static constexpr int VOCAB_SIZE = static_cast<int>(Alphabet::SYMBOLS.size());
+    static constexpr int INVALID_INDEX = -1;
+
+private:
+    static constexpr std::array<int, 256> LOOKUP_TABLE = [] {
+        std::array<int, 256> table{};
+        table.fill(INVALID_INDEX);
+        for (int i = 0; i < VOCAB_SIZE; ++i) {
+            table[static_cast<unsigned char>(Alphabet::SYMBOLS[i])] = i;
+        }
+        for (int c = 0; c < 256; ++c) {
+            if (table[c] == INVALID_INDEX) table[c] = table[Alphabet::fold(static_cast<unsigned char>(c))];
+        }
+        return table;
+    }();
+
+public:
+    constexpr int operator()(char c) const {
+        return LOOKUP_TABLE[static_cast<unsigned char>(c)];
+    }
+
+    constexpr char operator[](int index) const {
+        return (index >= 0 && index < VOCAB_SIZE) ? Alphabet::SYMBOLS[index] : '\0';
+    }
+
+    constexpr bool isSupported(char c) const {
+        return operator()(c) != INVALID_INDEX;
+    }
+};
+
+#ifndef VECTMO_ALPHABET
+#define VECTMO_ALPHABET Printable
+#endif
+using CharIndexMap = BasicCharIndexMap<VectmoAlphabet::VECTMO_ALPHABET>;
+
+static_assert(CharIndexMap()('\0') == CharIndexMap::INVALID_INDEX, "'\\0' marks a missing character");
+
+// Fixed-size vector for character histogram
+class CharHistogram {
+private:
+    std::array<double, CharIndexMap::VOCAB_SIZE> data{};
+
+public:
+    CharHistogram() = default;
+
+    explicit CharHistogram(std::string_view word, const CharIndexMap& charMap) {
+        for (char c : word) {
+            int idx = charMap(c);
+            if (idx != CharIndexMap::INVALID_INDEX) {
+                data[idx] += 1.0;
+            }
+        }
+    }
+
+    double dot(const CharHistogram& other) const {
+        return std::inner_product(data.begin(), data.end(), other.data.begin(), 0.0);
+    }
+
+    double magnitude() const {
+        double sum = std::accumulate(data.begin(), data.end(), 0.0, 
+            [](double acc, double val) { return acc + val * val; });
+        return std::sqrt(sum);
+    }
+
+    double cosineSimilarity(const CharHistogram& other) const {
+        double magA = magnitude();
+        double magB = other.magnitude();
+        
+        if (magA == 0.0 || magB == 0.0) return 0.0;
+        
+        return dot(other) / (magA * magB);
+    }
+
+    const auto& getData() const { return data; }
+};
+
+// Minimal allocator handing out cache-line aligned blocks for SIMD rows
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+    template <typename U> struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    // resize() default-initializes, leaving pages untouched until they are written
+    template <typename U> void construct(U* p) { ::new (static_cast<void*>(p)) U; }
+    template <typename U, typename... Args> void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+// Per-thread scratch memory for one request: a monotonic arena over a buffer
+// that is kept between requests. Nothing is freed until the outermost Scope
+// ends; reset() then grows the buffer by whatever the request had to take from
+// the heap, so repeated requests of similar size stop calling malloc at all.
+class VectmoArena {
+public:
+    static constexpr size_t INITIAL_BYTES = 64 * 1024;
+    static constexpr size_t MAX_RETAINED_BYTES = 16 * 1024 * 1024;  // one huge request is not kept forever
+
+private:
+    // Heap fallback for a request that outgrows the buffer; counts what it handed out
+    class Overflow : public std::pmr::memory_resource {
+    public:
+        size_t bytes = 0;
+
+    private:
+        void* do_allocate(size_t n, size_t alignment) override {
+            bytes += n;
+            return std::pmr::new_delete_resource()->allocate(n, alignment);
+        }
+        void do_deallocate(void* p, size_t n, size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(p, n, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+
+    std::unique_ptr<std::byte[]> buffer;
+    size_t capacity = 0;
+    Overflow overflow;
+    std::optional<std::pmr::monotonic_buffer_resource> arena;
+    int depth = 0;
+
+    void reset() {
+        arena.reset();  // hands overflow blocks back to the heap
+        size_t wanted = std::min(std::bit_ceil(capacity + overflow.bytes), MAX_RETAINED_BYTES);
+        overflow.bytes = 0;
+        if (wanted > capacity) {
+            buffer = std::make_unique_for_overwrite<std::byte[]>(wanted);
+            capacity = wanted;
+        }
+        arena.emplace(buffer.get(), capacity, &overflow);
+    }
+
+public:
+    explicit VectmoArena(size_t bytes = INITIAL_BYTES)
+        : buffer(std::make_unique_for_overwrite<std::byte[]>(bytes)), capacity(bytes) {
+        arena.emplace(buffer.get(), capacity, &overflow);
+    }
+
+    VectmoArena(const VectmoArena&) = delete;
+    VectmoArena& operator=(const VectmoArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &*arena; }
+    size_t bufferSize() const { return capacity; }
+
+    static VectmoArena& local() {
+        thread_local VectmoArena instance;
+        return instance;
+    }
+
+    // Scratch memory for code deep inside a request: this thread's arena while a
+    // Scope is open, the default heap otherwise
+    static std::pmr::memory_resource* scratch() {
+        VectmoArena& arena = local();
+        return arena.depth > 0 ? arena.resource() : std::pmr::get_default_resource();
+    }
+
+    static bool inScope() { return local().depth > 0; }
+
+    // A copy of text that lives as long as storage does
+    static std::string_view copy(std::string_view text, std::pmr::memory_resource* storage) {
+        if (text.empty()) return {};
+        char* bytes = static_cast<char*>(storage->allocate(text.size(), 1));
+        std::memcpy(bytes, text.data(), text.size());
+        return std::string_view(bytes, text.size());
+    }
+
+    // Brackets one request; scopes nest and only the outermost one resets, so
+    // nothing allocated inside may outlive it
+    class Scope {
+    private:
+        VectmoArena& arena;
+
+    public:
+        explicit Scope(VectmoArena& a = local()) : arena(a) { ++arena.depth; }
+        ~Scope() {
+            if (--arena.depth == 0) arena.reset();
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        std::pmr::memory_resource* resource() const { return arena.resource(); }
+    };
+};
+
+// Batched dot products of one query row against many rows, picked once for the running CPU
+namespace VectmoKernels {
+    // Rows are padded to a multiple of this many floats (one 64-byte cache line)
+    constexpr size_t LANES = 16;
+
+    using DotRowsFn = void (*)(const float* query, const float* rows, size_t count, size_t width, float* out);
+
+    inline void dotRowsScalar(const float* query, const float* rows, size_t count, size_t width, float* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            float sum = 0.0f;
+            for (size_t i = 0; i < width; ++i) sum += query[i] * rows[i];
+            out[r] = sum;
+        }
+    }
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    __attribute__((target("avx2,fma")))
+    inline void dotRowsAvx2(const float* query, const float* rows, size_t count, size_t width, float* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            for (size_t i = 0; i < width; i += 16) {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), _mm256_loadu_ps(rows + i), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i + 8), _mm256_loadu_ps(rows + i + 8), acc1);
+            }
+            __m256 acc = _mm256_add_ps(acc0, acc1);
+            __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            sum = _mm_hadd_ps(sum, sum);
+            sum = _mm_hadd_ps(sum, sum);
+            out[r] = _mm_cvtss_f32(sum);
+        }
+    }
+
+    // GCC 12's own reduce intrinsics trip -Wmaybe-uninitialized on _mm256_undefined_pd
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    __attribute__((target("avx512f")))
+    inline void dotRowsAvx512(const float* query, const float* rows, size_t count, size_t width, float* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            __m512 acc = _mm512_setzero_ps();
+            for (size_t i = 0; i < width; i += 16) {
+                acc = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), _mm512_loadu_ps(rows + i), acc);
+            }
+            out[r] = _mm512_reduce_add_ps(acc);
+        }
+    }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    inline void dotRowsNeon(const float* query, const float* rows, size_t count, size_t width, float* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            float32x4_t acc0 = vdupq_n_f32(0.0f);
+            float32x4_t acc1 = vdupq_n_f32(0.0f);
+            for (size_t i = 0; i < width; i += 8) {
+                acc0 = vfmaq_f32(acc0, vld1q_f32(query + i), vld1q_f32(rows + i));
+                acc1 = vfmaq_f32(acc1, vld1q_f32(query + i + 4), vld1q_f32(rows + i + 4));
+            }
+            out[r] = vaddvq_f32(vaddq_f32(acc0, acc1));
+        }
+    }
+#endif
+
+    // Compact rows: uint8 counts against an int8 query, accumulated exactly in int32
+    constexpr size_t COMPACT_LANES = 32;
+
+    using DotRowsCompactFn = void (*)(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                      int32_t* out);
+
+    inline void dotRowsCompactScalar(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                     int32_t* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            int32_t sum = 0;
+            for (size_t i = 0; i < width; ++i) sum += static_cast<int32_t>(query[i]) * rows[i];
+            out[r] = sum;
+        }
+    }
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    __attribute__((target("avx2")))
+    inline int32_t horizontalSum(__m256i acc) {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+    }
+
+    // Widens to 16 bits before madd, so unlike maddubs nothing can saturate
+    __attribute__((target("avx2")))
+    inline void dotRowsCompactAvx2(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                   int32_t* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            __m256i acc = _mm256_setzero_si256();
+            for (size_t i = 0; i < width; i += 16) {
+                __m256i q = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(query + i)));
+                __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + i)));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(q, v));
+            }
+            out[r] = horizontalSum(acc);
+        }
+    }
+
+    __attribute__((target("avx2,avxvnni")))
+    inline void dotRowsCompactAvxVnni(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                      int32_t* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            __m256i acc = _mm256_setzero_si256();
+            for (size_t i = 0; i < width; i += 32) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + i));
+                __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + i));
+                acc = _mm256_dpbusd_avx_epi32(acc, v, q);
+            }
+            out[r] = horizontalSum(acc);
+        }
+    }
+
+    __attribute__((target("avx2,avx512vl,avx512vnni")))
+    inline void dotRowsCompactAvx512Vnni(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                         int32_t* out) {
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            __m256i acc = _mm256_setzero_si256();
+            for (size_t i = 0; i < width; i += 32) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + i));
+                __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + i));
+                acc = _mm256_dpbusd_epi32(acc, v, q);
+            }
+            out[r] = horizontalSum(acc);
+        }
+    }
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    // Query entries are never negative, so they can be read as unsigned bytes
+    inline void dotRowsCompactNeon(const int8_t* query, const uint8_t* rows, size_t count, size_t width,
+                                   int32_t* out) {
+        const uint8_t* q = reinterpret_cast<const uint8_t*>(query);
+        for (size_t r = 0; r < count; ++r, rows += width) {
+            uint32x4_t acc = vdupq_n_u32(0);
+            for (size_t i = 0; i < width; i += 16) {
+#if defined(__ARM_FEATURE_DOTPROD)
+                acc = vdotq_u32(acc, vld1q_u8(q + i), vld1q_u8(rows + i));
+#else
+                uint16x8_t lo = vmull_u8(vld1_u8(q + i), vld1_u8(rows + i));
+                uint16x8_t hi = vmull_u8(vld1_u8(q + i + 8), vld1_u8(rows + i + 8));
+                acc = vpadalq_u16(vpadalq_u16(acc, lo), hi);
+#endif
+            }
+            out[r] = static_cast<int32_t>(vaddvq_u32(acc));
+        }
+    }
+#endif
+
+    // Byte classification: out[i] = table[in[i]] over a 256-entry table, used to
+    // turn corpus text into character indices a block at a time
+    using MapBytesFn = void (*)(const uint8_t* table, uint8_t invalid, const char* in, size_t n, uint8_t* out);
+
+    inline void mapBytesScalar(const uint8_t* table, uint8_t, const char* in, size_t n, uint8_t* out) {
+        for (size_t i = 0; i < n; ++i) out[i] = table[static_cast<unsigned char>(in[i])];
+    }
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    // pshufb looks up the low nibble in the 16-entry slice for each high nibble;
+    // slices holding only `invalid` are skipped, so ASCII alphabets cost a few
+    // shuffles per 32 bytes. Alphabets spread over most slices go scalar.
+    __attribute__((target("avx2")))
+    inline void mapBytesAvx2(const uint8_t* table, uint8_t invalid, const char* in, size_t n, uint8_t* out) {
+        __m256i slices[16];
+        __m256i highs[16];
+        int used = 0;
+        for (int h = 0; h < 16; ++h) {
+            const uint8_t* slice = table + h * 16;
+            if (std::all_of(slice, slice + 16, [&](uint8_t v) { return v == invalid; })) continue;
+            slices[used] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(slice)));
+            highs[used] = _mm256_set1_epi8(static_cast<char>(h));
+            ++used;
+        }
+        if (used > 8) {
+            mapBytesScalar(table, invalid, in, n, out);
+            return;
+        }
+
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        const __m256i fill = _mm256_set1_epi8(static_cast<char>(invalid));
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+            __m256i low = _mm256_and_si256(bytes, nibble);
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+            __m256i result = fill;
+            for (int k = 0; k < used; ++k) {
+                __m256i hit = _mm256_cmpeq_epi8(high, highs[k]);
+                result = _mm256_blendv_epi8(result, _mm256_shuffle_epi8(slices[k], low), hit);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), result);
+        }
+        mapBytesScalar(table, invalid, in + i, n - i, out + i);
+    }
+
+    // Two 128-entry permutes cover the whole table; the sign bit picks the half
+    __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+    inline void mapBytesAvx512Vbmi(const uint8_t* table, uint8_t invalid, const char* in, size_t n, uint8_t* out) {
+        const __m512i t0 = _mm512_loadu_si512(table);
+        const __m512i t1 = _mm512_loadu_si512(table + 64);
+        const __m512i t2 = _mm512_loadu_si512(table + 128);
+        const __m512i t3 = _mm512_loadu_si512(table + 192);
+        size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            __m512i bytes = _mm512_loadu_si512(in + i);
+            __m512i low = _mm512_permutex2var_epi8(t0, bytes, t1);
+            __m512i high = _mm512_permutex2var_epi8(t2, bytes, t3);
+            _mm512_storeu_si512(out + i, _mm512_mask_blend_epi8(_mm512_movepi8_mask(bytes), low, high));
+        }
+        mapBytesScalar(table, invalid, in + i, n - i, out + i);
+    }
+#endif
+
+    struct Kernel {
+        DotRowsFn dotRows;
+        const char* name;
+        DotRowsCompactFn dotRowsCompact;
+        const char* compactName;
+        MapBytesFn mapBytes;
+        const char* mapName;
+    };
+
+    inline Kernel selectKernel() {
+        Kernel kernel{dotRowsScalar, "scalar", dotRowsCompactScalar, "scalar", mapBytesScalar, "scalar"};
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            kernel.dotRows = dotRowsAvx512;
+            kernel.name = "avx512";
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            kernel.dotRows = dotRowsAvx2;
+            kernel.name = "avx2";
+        }
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+            kernel.dotRowsCompact = dotRowsCompactAvx512Vnni;
+            kernel.compactName = "avx512-vnni";
+        } else if (__builtin_cpu_supports("avxvnni")) {
+            kernel.dotRowsCompact = dotRowsCompactAvxVnni;
+            kernel.compactName = "avx-vnni";
+        } else if (__builtin_cpu_supports("avx2")) {
+            kernel.dotRowsCompact = dotRowsCompactAvx2;
+            kernel.compactName = "avx2";
+        }
+        if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+            kernel.mapBytes = mapBytesAvx512Vbmi;
+            kernel.mapName = "avx512-vbmi";
+        } else if (__builtin_cpu_supports("avx2")) {
+            kernel.mapBytes = mapBytesAvx2;
+            kernel.mapName = "avx2";
+        }
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        kernel.dotRows = dotRowsNeon;
+        kernel.name = "neon";
+        kernel.dotRowsCompact = dotRowsCompactNeon;
+#if defined(__ARM_FEATURE_DOTPROD)
+        kernel.compactName = "neon-dotprod";
+#else
+        kernel.compactName = "neon";
+#endif
+#endif
+        return kernel;
+    }
+
+    inline const Kernel active = selectKernel();
+}
+
+// Float32 rows score exactly like the original doubles; Uint8 rows hold the same
+// counts (saturated at 255) in a quarter of the memory
+enum class EmbeddingPrecision : uint32_t { Float32 = 0, Uint8 = 1 };
+
+// One bit per character index; two words share a character iff their masks overlap
+struct CharPresenceMask {
+    static constexpr size_t WORDS = (CharIndexMap::VOCAB_SIZE + 63) / 64;
+
+    uint64_t bits[WORDS] = {};
+
+    void set(size_t c) { bits[c >> 6] |= uint64_t{1} << (c & 63); }
+    bool overlaps(const CharPresenceMask& other) const {
+        uint64_t any = 0;
+        for (size_t w = 0; w < WORDS; ++w) any |= bits[w] & other.bits[w];
+        return any != 0;
+    }
+    // Number of characters both words contain
+    int sharedCount(const CharPresenceMask& other) const {
+        int shared = 0;
+        for (size_t w = 0; w < WORDS; ++w) shared += std::popcount(bits[w] & other.bits[w]);
+        return shared;
+    }
+};
+
+// Query side of a scan: the word's histogram as padded float and int8 rows plus their inverse norms.
+// Short words also keep their few non-zero indices so rows can be scored sparsely.
+struct EmbeddingQuery {
+    static constexpr size_t ROW_WIDTH =
+        (CharIndexMap::VOCAB_SIZE + VectmoKernels::LANES - 1) / VectmoKernels::LANES * VectmoKernels::LANES;
+    static constexpr size_t COMPACT_ROW_WIDTH =
+        (CharIndexMap::VOCAB_SIZE + VectmoKernels::COMPACT_LANES - 1) / VectmoKernels::COMPACT_LANES *
+        VectmoKernels::COMPACT_LANES;
+
+    alignas(64) std::array<float, ROW_WIDTH> row{};
+    alignas(64) std::array<int8_t, COMPACT_ROW_WIDTH> compactRow{};
+    double inverseNorm = 0.0;
+    double compactInverseNorm = 0.0;  // of compactRow, which saturates at 127
+    size_t length = 0;
+
+    // Past this many distinct characters the dense kernel is the faster path
+    static constexpr size_t SPARSE_LIMIT = 12;
+    CharPresenceMask mask;
+    std::array<uint8_t, SPARSE_LIMIT> sparseIndices{};
+    size_t distinct = 0;
+
+    EmbeddingQuery(const CharHistogram& histogram, size_t wordLength) : length(wordLength) {
+        const auto& data = histogram.getData();
+        std::copy(data.begin(), data.end(), row.begin());
+        double compactSquares = 0.0;
+        for (size_t i = 0; i < data.size(); ++i) {
+            compactRow[i] = static_cast<int8_t>(std::min(data[i], 127.0));
+            compactSquares += static_cast<double>(compactRow[i]) * compactRow[i];
+            if (data[i] == 0.0) continue;
+            mask.set(i);
+            if (distinct < SPARSE_LIMIT) sparseIndices[distinct] = static_cast<uint8_t>(i);
+            ++distinct;
+        }
+        double magnitude = histogram.magnitude();
+        inverseNorm = magnitude > 0.0 ? 1.0 / magnitude : 0.0;
+        compactInverseNorm = compactSquares > 0.0 ? 1.0 / std::sqrt(compactSquares) : 0.0;
+    }
+
+    bool isSparse() const { return distinct <= SPARSE_LIMIT; }
+
+    // Norm of the row a store of this precision scores against
+    double inverseNormFor(EmbeddingPrecision precision) const {
+        return precision == EmbeddingPrecision::Uint8 ? compactInverseNorm : inverseNorm;
+    }
+};
+
+// Read-only bytes of a whole file: memory mapped where the platform allows,
+// otherwise read into an aligned buffer
+class MappedFile {
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    std::vector<char, AlignedAllocator<char>> fallback;
+
+    MappedFile() = default;
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef VECTMO_HAS_MMAP
+        if (bytes && fallback.empty()) munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    static std::shared_ptr<const MappedFile> open(const std::string& path) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef VECTMO_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return nullptr;
+        file->bytes = static_cast<const char*>(mapped);
+        file->length = static_cast<size_t>(info.st_size);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return nullptr;
+        file->fallback.resize(static_cast<size_t>(in.tellg()));
+        in.seekg(0);
+        if (file->fallback.empty() || !in.read(file->fallback.data(), file->fallback.size())) return nullptr;
+        file->bytes = file->fallback.data();
+        file->length = file->fallback.size();
+#endif
+        return file;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Interned training vocabulary: every distinct word is stored once in an append-only
+// pool and gets a dense id from a flat open-addressing table. Lookups never compare
+// strings unless their hashes match, and ordering is only produced on request.
+class VocabularyTable {
+private:
+    static constexpr uint32_t EMPTY_SLOT = 0;  // slots hold id + 1
+
+    std::vector<char> pool;
+    std::vector<uint64_t> offsets{0};
+    std::vector<uint32_t> hashes;  // per id, so growing never rehashes strings
+    std::vector<uint32_t> slots;
+
+    static uint32_t hashWord(std::string_view word) {
+        uint64_t h = std::hash<std::string_view>{}(word);
+        return static_cast<uint32_t>(h ^ (h >> 32));
+    }
+
+    void grow() {
+        std::vector<uint32_t> next(std::max<size_t>(slots.size() * 2, 64), EMPTY_SLOT);
+        size_t mask = next.size() - 1;
+        for (uint32_t id = 0; id < size(); ++id) {
+            size_t slot = hashes[id] & mask;
+            while (next[slot] != EMPTY_SLOT) slot = (slot + 1) & mask;
+            next[slot] = id + 1;
+        }
+        slots = std::move(next);
+    }
+
+public:
+    size_t size() const { return hashes.size(); }
+    bool empty() const { return hashes.empty(); }
+
+    std::string_view word(uint32_t id) const {
+        return std::string_view(pool.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    std::optional<uint32_t> find(std::string_view word) const {
+        if (slots.empty()) return std::nullopt;
+        uint32_t h = hashWord(word);
+        size_t mask = slots.size() - 1;
+        for (size_t slot = h & mask; slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+            uint32_t id = slots[slot] - 1;
+            if (hashes[id] == h && this->word(id) == word) return id;
+        }
+        return std::nullopt;
+    }
+
+    // Id of the word, adding it on first sight
+    uint32_t intern(std::string_view word) {
+        // Kept at most half full so probe runs stay short
+        if ((size() + 1) * 2 > slots.size()) grow();
+        uint32_t h = hashWord(word);
+        size_t mask = slots.size() - 1;
+        size_t slot = h & mask;
+        for (; slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+            uint32_t id = slots[slot] - 1;
+            if (hashes[id] == h && this->word(id) == word) return id;
+        }
+
+        uint32_t id = static_cast<uint32_t>(size());
+        pool.insert(pool.end(), word.begin(), word.end());
+        offsets.push_back(pool.size());
+        hashes.push_back(h);
+        slots[slot] = id + 1;
+        return id;
+    }
+
+    // Views of every word in sorted order; valid until the next intern() or clear()
+    std::vector<std::string_view> sortedWords() const {
+        std::vector<std::string_view> words;
+        words.reserve(size());
+        for (uint32_t id = 0; id < size(); ++id) words.push_back(word(id));
+        std::sort(words.begin(), words.end());
+        return words;
+    }
+
+    // Drops the words and gives their memory back
+    void clear() {
+        std::vector<char>().swap(pool);
+        std::vector<uint64_t>{0}.swap(offsets);
+        std::vector<uint32_t>().swap(hashes);
+        std::vector<uint32_t>().swap(slots);
+    }
+};
+
+// Structure-of-arrays embedding store: one aligned row per word, with its norm
+// precomputed and the words themselves in an offset-indexed string pool.
+// The arrays are either owned or borrowed from a mapped model file. Owned rows
+// may be deferred: the words are usable at once and each chunk of rows is
+// filled the first time something scores it, or earlier by a background thread.
+class EmbeddingStore {
+public:
+    static constexpr size_t ROW_WIDTH = EmbeddingQuery::ROW_WIDTH;
+    static constexpr size_t COMPACT_ROW_WIDTH = EmbeddingQuery::COMPACT_ROW_WIDTH;
+    // Rows scored per kernel call; the dot buffer stays on the stack
+    static constexpr size_t SCORE_BLOCK = 256;
+    // Rows filled together when rows are deferred
+    static constexpr size_t LAZY_CHUNK_ROWS = 4096;
+
+private:
+    // Writes row i from its word; holds heap pointers, so it survives moving the store
+    struct RowWriter {
+        float* rows = nullptr;
+        uint8_t* compactRows = nullptr;
+        double* inverseNorms = nullptr;
+        CharPresenceMask* masks = nullptr;
+        const uint64_t* wordOffsets = nullptr;
+        const char* wordPool = nullptr;
+        EmbeddingPrecision precision = EmbeddingPrecision::Float32;
+
+        void fill(size_t i, const CharIndexMap& charMap) const {
+            std::array<uint32_t, CharIndexMap::VOCAB_SIZE> counts{};
+            for (size_t k = wordOffsets[i]; k < wordOffsets[i + 1]; ++k) {
+                int idx = charMap(wordPool[k]);
+                if (idx != CharIndexMap::INVALID_INDEX) ++counts[idx];
+            }
+
+            // The norm is taken over the stored values so saturated compact rows stay consistent
+            double sumSquares = 0.0;
+            if (precision == EmbeddingPrecision::Uint8) {
+                uint8_t* row = compactRows + i * COMPACT_ROW_WIDTH;
+                for (size_t c = 0; c < counts.size(); ++c) {
+                    row[c] = static_cast<uint8_t>(std::min<uint32_t>(counts[c], 255));
+                    sumSquares += static_cast<double>(row[c]) * row[c];
+                }
+                std::fill(row + counts.size(), row + COMPACT_ROW_WIDTH, uint8_t{0});
+            } else {
+                float* row = rows + i * ROW_WIDTH;
+                for (size_t c = 0; c < counts.size(); ++c) {
+                    row[c] = static_cast<float>(counts[c]);
+                    sumSquares += static_cast<double>(counts[c]) * counts[c];
+                }
+                std::fill(row + counts.size(), row + ROW_WIDTH, 0.0f);
+            }
+            inverseNorms[i] = sumSquares > 0.0 ? 1.0 / std::sqrt(sumSquares) : 0.0;
+            masks[i] = CharPresenceMask{};
+            for (size_t c = 0; c < counts.size(); ++c) {
+                if (counts[c] > 0) masks[i].set(c);
+            }
+        }
+    };
+
+    // Per-chunk fill state of deferred rows. Whoever claims a chunk fills it and
+    // everyone else waits for it, so each row is written exactly once.
+    class LazyRows {
+    private:
+        enum : uint8_t { EMPTY, FILLING, READY };
+
+        RowWriter writer;
+        size_t count;
+        size_t chunkCount;
+        std::unique_ptr<std::atomic<uint8_t>[]> states;
+        std::atomic<size_t> readyChunks{0};
+        std::atomic<bool> complete{false};
+        std::atomic<bool> stopping{false};
+        std::thread background;
+
+    public:
+        LazyRows(const RowWriter& rowWriter, size_t rowCount, bool fillInBackground)
+            : writer(rowWriter), count(rowCount), chunkCount((rowCount + LAZY_CHUNK_ROWS - 1) / LAZY_CHUNK_ROWS),
+              states(std::make_unique<std::atomic<uint8_t>[]>(chunkCount)) {
+            if (chunkCount == 0) complete.store(true);
+            if (fillInBackground && chunkCount > 0) {
+                background = std::thread([this] {
+                    for (size_t c = 0; c < chunkCount && !stopping.load(std::memory_order_relaxed); ++c) ensureChunk(c);
+                });
+            }
+        }
+
+        ~LazyRows() {
+            stopping.store(true, std::memory_order_relaxed);
+            if (background.joinable()) background.join();
+        }
+
+        bool isComplete() const { return complete.load(std::memory_order_acquire); }
+
+        void ensureChunk(size_t c) {
+            std::atomic<uint8_t>& state = states[c];
+            uint8_t seen = state.load(std::memory_order_acquire);
+            if (seen == READY) return;
+            if (seen == EMPTY && state.compare_exchange_strong(seen, FILLING, std::memory_order_acquire)) {
+                CharIndexMap charMap;
+                size_t last = std::min((c + 1) * LAZY_CHUNK_ROWS, count);
+                for (size_t i = c * LAZY_CHUNK_ROWS; i < last; ++i) writer.fill(i, charMap);
+                state.store(READY, std::memory_order_release);
+                state.notify_all();
+                // The last chunk's increment has seen every other chunk's release
+                if (readyChunks.fetch_add(1, std::memory_order_acq_rel) + 1 == chunkCount) {
+                    complete.store(true, std::memory_order_release);
+                }
+                return;
+            }
+            while ((seen = state.load(std::memory_order_acquire)) != READY) state.wait(seen);
+        }
+
+        void ensureRange(size_t first, size_t n) {
+            if (n == 0 || isComplete()) return;
+            for (size_t c = first / LAZY_CHUNK_ROWS; c <= (first + n - 1) / LAZY_CHUNK_ROWS; ++c) ensureChunk(c);
+        }
+    };
+
+    // First, so moving a store stops the old filler before its buffers go
+    std::unique_ptr<LazyRows> lazy;
+    std::vector<float, AlignedAllocator<float>> ownedRows;
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> ownedCompactRows;
+    std::vector<double> ownedNorms;
+    std::vector<CharPresenceMask> ownedMasks;
+    std::vector<uint64_t> ownedOffsets;
+    std::vector<char> ownedPool;
+    std::shared_ptr<const MappedFile> mapping;
+
+    // Views every accessor goes through, pointing at owned or mapped memory
+    const float* rows = nullptr;
+    const uint8_t* compactRows = nullptr;
+    const double* inverseNorms = nullptr;
+    const CharPresenceMask* masks = nullptr;
+    const uint64_t* wordOffsets = nullptr;
+    const char* wordPool = nullptr;
+    size_t count = 0;
+    EmbeddingPrecision precision = EmbeddingPrecision::Float32;
+
+public:
+    EmbeddingStore() = default;
+    EmbeddingStore(const EmbeddingStore&) = delete;
+    EmbeddingStore& operator=(const EmbeddingStore&) = delete;
+    EmbeddingStore(EmbeddingStore&& other) noexcept { *this = std::move(other); }
+
+    // The views move along: owned vectors keep their heap buffers and the
+    // mapping its pages, so only the source is left pointing at nothing
+    EmbeddingStore& operator=(EmbeddingStore&& other) noexcept {
+        if (this == &other) return *this;
+        clear();
+        lazy = std::move(other.lazy);
+        ownedRows = std::move(other.ownedRows);
+        ownedCompactRows = std::move(other.ownedCompactRows);
+        ownedNorms = std::move(other.ownedNorms);
+        ownedMasks = std::move(other.ownedMasks);
+        ownedOffsets = std::move(other.ownedOffsets);
+        ownedPool = std::move(other.ownedPool);
+        mapping = std::move(other.mapping);
+        rows = other.rows;
+        compactRows = other.compactRows;
+        inverseNorms = other.inverseNorms;
+        masks = other.masks;
+        wordOffsets = other.wordOffsets;
+        wordPool = other.wordPool;
+        count = other.count;
+        precision = other.precision;
+        other.clear();
+        return *this;
+    }
+    ~EmbeddingStore() { lazy.reset(); }
+
+    // Rows of the embedding store can be built up front or deferred (see LazyRows)
+    enum class RowBuild { Eager, Deferred, Background };
+
+    template <typename WordRange>
+    void build(const WordRange& vocabulary, const CharIndexMap& charMap, unsigned threadCount = 1,
+               EmbeddingPrecision rowPrecision = EmbeddingPrecision::Float32, RowBuild rowBuild = RowBuild::Eager) {
+        std::vector<char> pool;
+        std::vector<uint64_t> offsets;
+        offsets.reserve(vocabulary.size() + 1);
+        offsets.push_back(0);
+        for (const auto& word : vocabulary) {
+            pool.insert(pool.end(), word.begin(), word.end());
+            offsets.push_back(pool.size());
+        }
+        adopt(std::move(pool), std::move(offsets), charMap, threadCount, rowPrecision, rowBuild);
+    }
+
+    // Takes over an already sorted string pool: word i is pool[offsets[i], offsets[i + 1])
+    void adopt(std::vector<char> pool, std::vector<uint64_t> offsets, const CharIndexMap& charMap,
+               unsigned threadCount = 1, EmbeddingPrecision rowPrecision = EmbeddingPrecision::Float32,
+               RowBuild rowBuild = RowBuild::Eager) {
+        clear();
+        precision = rowPrecision;
+        ownedPool = std::move(pool);
+        ownedOffsets = std::move(offsets);
+        if (ownedOffsets.empty()) ownedOffsets.push_back(0);
+        count = ownedOffsets.size() - 1;
+
+        // Only the rows of the chosen precision are allocated; each is written
+        // whole by RowWriter, so deferred rows cost no memory until filled
+        if (precision == EmbeddingPrecision::Uint8) {
+            ownedCompactRows.resize(count * COMPACT_ROW_WIDTH);
+        } else {
+            ownedRows.resize(count * ROW_WIDTH);
+        }
+        ownedNorms.assign(count, 0.0);
+        ownedMasks.assign(count, CharPresenceMask{});
+        bindOwned();
+        RowWriter writer{ownedRows.data(), ownedCompactRows.data(), ownedNorms.data(), ownedMasks.data(),
+                         ownedOffsets.data(), ownedPool.data(), precision};
+        if (rowBuild != RowBuild::Eager) {
+            lazy = std::make_unique<LazyRows>(writer, count, rowBuild == RowBuild::Background);
+            return;
+        }
+
+        // Rows are independent, so large vocabularies are filled in parallel slices
+        unsigned shards = static_cast<unsigned>(std::min<size_t>(threadCount, count));
+        VectmoThreads::runShards(std::max(1u, shards), [&](unsigned t) {
+            size_t begin = count * t / std::max(1u, shards);
+            size_t end = count * (t + 1) / std::max(1u, shards);
+            for (size_t i = begin; i < end; ++i) writer.fill(i, charMap);
+        });
+    }
+
+    // Fills any deferred rows in [first, first + n); everything that reads rows,
+    // norms or masks goes through this (the scoring functions do it themselves)
+    void materialize(size_t first, size_t n) const {
+        if (lazy) lazy->ensureRange(first, n);
+    }
+    void materializeAll() const { materialize(0, count); }
+    bool isMaterialized() const { return !lazy || lazy->isComplete(); }
+
+    // Borrows every array from a mapped file; nothing is copied or parsed.
+    // rowData holds float or uint8 rows depending on rowPrecision; files without
+    // presence masks (maskData == nullptr) get them recomputed from the rows
+    void attach(std::shared_ptr<const MappedFile> file, size_t wordCount, EmbeddingPrecision rowPrecision,
+                const void* rowData, const double* normData, const CharPresenceMask* maskData,
+                const uint64_t* offsetData, const char* poolData) {
+        clear();
+        mapping = std::move(file);
+        count = wordCount;
+        precision = rowPrecision;
+        if (precision == EmbeddingPrecision::Uint8) {
+            compactRows = static_cast<const uint8_t*>(rowData);
+        } else {
+            rows = static_cast<const float*>(rowData);
+        }
+        inverseNorms = normData;
+        wordOffsets = offsetData;
+        wordPool = poolData;
+        masks = maskData;
+        if (!masks) {
+            ownedMasks.assign(count, CharPresenceMask{});
+            for (size_t i = 0; i < count; ++i) {
+                for (size_t c = 0; c < CharIndexMap::VOCAB_SIZE; ++c) {
+                    if (charCount(i, c) > 0) ownedMasks[i].set(c);
+                }
+            }
+            masks = ownedMasks.data();
+        }
+    }
+
+    void clear() {
+        lazy.reset();
+        ownedRows.clear();
+        ownedCompactRows.clear();
+        ownedNorms.clear();
+        ownedMasks.clear();
+        ownedOffsets.clear();
+        ownedPool.clear();
+        mapping.reset();
+        rows = nullptr;
+        compactRows = nullptr;
+        inverseNorms = nullptr;
+        masks = nullptr;
+        wordOffsets = nullptr;
+        wordPool = nullptr;
+        count = 0;
+        precision = EmbeddingPrecision::Float32;
+    }
+
+private:
+    void bindOwned() {
+        rows = ownedRows.empty() ? nullptr : ownedRows.data();
+        compactRows = ownedCompactRows.empty() ? nullptr : ownedCompactRows.data();
+        inverseNorms = ownedNorms.data();
+        masks = ownedMasks.data();
+        wordOffsets = ownedOffsets.data();
+        wordPool = ownedPool.data();
+    }
+
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool isMapped() const { return mapping != nullptr; }
+
+    std::string_view word(size_t i) const {
+        return std::string_view(wordPool + wordOffsets[i], wordOffsets[i + 1] - wordOffsets[i]);
+    }
+    EmbeddingPrecision getPrecision() const { return precision; }
+    // Float rows exist only at Float32 precision, compact rows only at Uint8
+    const float* row(size_t i) const { return rows + i * ROW_WIDTH; }
+    const uint8_t* compactRow(size_t i) const { return compactRows + i * COMPACT_ROW_WIDTH; }
+    double inverseNorm(size_t i) const { return inverseNorms[i]; }
+    const CharPresenceMask& mask(size_t i) const { return masks[i]; }
+
+    // Occurrences of character index c in word i, whichever precision is stored
+    uint32_t charCount(size_t i, size_t c) const {
+        if (precision == EmbeddingPrecision::Uint8) return compactRow(i)[c];
+        return static_cast<uint32_t>(row(i)[c]);
+    }
+
+    // Raw arrays, as written to the binary model format
+    const void* rowData() const {
+        return precision == EmbeddingPrecision::Uint8 ? static_cast<const void*>(compactRows)
+                                                      : static_cast<const void*>(rows);
+    }
+    size_t rowBytes() const {
+        return precision == EmbeddingPrecision::Uint8 ? COMPACT_ROW_WIDTH : ROW_WIDTH * sizeof(float);
+    }
+    const double* normData() const { return inverseNorms; }
+    const CharPresenceMask* maskData() const { return masks; }
+    const uint64_t* offsetData() const { return wordOffsets; }
+    const char* poolData() const { return wordPool; }
+    size_t poolSize() const { return count > 0 ? wordOffsets[count] : 0; }
+
+    // Cosine scores of the query against rows [first, first + n)
+    void scoreRange(const EmbeddingQuery& query, size_t first, size_t n, double* out) const {
+        materialize(first, n);
+        // Compact rows are a cache line and a half; the dense integer kernel already wins there
+        if (query.isSparse() && precision == EmbeddingPrecision::Float32) {
+            scoreRangeSparse(query, first, n, out);
+            return;
+        }
+        if (precision == EmbeddingPrecision::Uint8) {
+            alignas(64) int32_t dots[SCORE_BLOCK];
+            for (size_t done = 0; done < n; done += SCORE_BLOCK) {
+                size_t block = std::min(SCORE_BLOCK, n - done);
+                VectmoKernels::active.dotRowsCompact(query.compactRow.data(), compactRow(first + done), block,
+                                                     COMPACT_ROW_WIDTH, dots);
+                for (size_t k = 0; k < block; ++k) {
+                    out[done + k] = dots[k] * inverseNorms[first + done + k] * query.compactInverseNorm;
+                }
+            }
+            return;
+        }
+
+        alignas(64) float dots[SCORE_BLOCK];
+        for (size_t done = 0; done < n; done += SCORE_BLOCK) {
+            size_t block = std::min(SCORE_BLOCK, n - done);
+            VectmoKernels::active.dotRows(query.row.data(), row(first + done), block, ROW_WIDTH, dots);
+            for (size_t k = 0; k < block; ++k) {
+                out[done + k] = dots[k] * inverseNorms[first + done + k] * query.inverseNorm;
+            }
+        }
+    }
+
+    // Short queries touch only their own few characters of each float row, and rows
+    // that share none of them score 0 without being read. Counts are small integers,
+    // so the sum is exact and matches the dense kernel bit for bit.
+    void scoreRangeSparse(const EmbeddingQuery& query, size_t first, size_t n, double* out) const {
+        std::fill(out, out + n, 0.0);
+
+        // Branch-free compaction of the overlapping rows, then a gather over just those
+        uint32_t hits[SCORE_BLOCK];
+        for (size_t done = 0; done < n; done += SCORE_BLOCK) {
+            size_t block = std::min(SCORE_BLOCK, n - done);
+            size_t hitCount = 0;
+            for (size_t k = 0; k < block; ++k) {
+                hits[hitCount] = static_cast<uint32_t>(done + k);
+                hitCount += masks[first + done + k].overlaps(query.mask);
+            }
+
+            for (size_t h = 0; h < hitCount; ++h) {
+                size_t i = first + hits[h];
+                out[hits[h]] = sparseDot(query, i) * inverseNorms[i] * query.inverseNorm;
+            }
+        }
+    }
+
+    // Cosine scores of the query against an arbitrary list of rows
+    void scoreRows(const EmbeddingQuery& query, const uint32_t* ids, size_t n, double* out) const {
+        if (!isMaterialized()) {
+            for (size_t k = 0; k < n; ++k) materialize(ids[k], 1);
+        }
+        const bool sparse = query.isSparse() && precision == EmbeddingPrecision::Float32;
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = ids[k];
+            if (sparse) {
+                out[k] = masks[i].overlaps(query.mask)
+                             ? sparseDot(query, i) * inverseNorms[i] * query.inverseNorm
+                             : 0.0;
+            } else if (precision == EmbeddingPrecision::Uint8) {
+                int32_t dot;
+                VectmoKernels::active.dotRowsCompact(query.compactRow.data(), compactRow(i), 1,
+                                                     COMPACT_ROW_WIDTH, &dot);
+                out[k] = dot * inverseNorms[i] * query.compactInverseNorm;
+            } else {
+                float dot;
+                VectmoKernels::active.dotRows(query.row.data(), row(i), 1, ROW_WIDTH, &dot);
+                out[k] = dot * inverseNorms[i] * query.inverseNorm;
+            }
+        }
+    }
+
+    double score(const EmbeddingQuery& query, size_t i) const {
+        double out;
+        scoreRange(query, i, 1, &out);
+        return out;
+    }
+
+private:
+    float sparseDot(const EmbeddingQuery& query, size_t i) const {
+        const float* r = row(i);
+        float dot = 0.0f;
+        for (size_t e = 0; e < query.distinct; ++e) {
+            size_t c = query.sparseIndices[e];
+            dot += query.row[c] * r[c];
+        }
+        return dot;
+    }
+};
+
+// Pluggable nearest-neighbour search over the embedding store
+class SimilarityIndex {
+public:
+    virtual ~SimilarityIndex() = default;
+
+    // Called from cacheEmbeddings(); the store stays valid until the next build
+    virtual void build(const EmbeddingStore& store) = 0;
+
+    // Row of the best word for the query, or nullopt if the store is empty
+    virtual std::optional<size_t> findNearest(const EmbeddingQuery& query) const = 0;
+
+    // One result per query; indexes that can share a pass over the store override this
+    virtual void findNearestBatch(std::span<const EmbeddingQuery> queries,
+                                  std::span<std::optional<size_t>> out) const {
+        for (size_t j = 0; j < queries.size(); ++j) out[j] = findNearest(queries[j]);
+    }
+
+    // One entry of a top-k result: a store row and its cosine score
+    struct Neighbor {
+        uint32_t row = 0;
+        double score = -1.0;
+    };
+
+    // The out.size() best rows for the query, best first; returns how many were
+    // written, fewer only when there are fewer candidates. Ranked like
+    // findNearest with any remaining tie going to the earlier row, so out[0] is
+    // always findNearest's answer.
+    virtual size_t findTopK(const EmbeddingQuery& query, std::span<Neighbor> out) const = 0;
+
+    // k = out.size() / queries.size() entries per query, query j's starting at
+    // out[j * k]; counts[j] is how many of them were written
+    virtual void findTopKBatch(std::span<const EmbeddingQuery> queries, std::span<Neighbor> out,
+                               std::span<size_t> counts) const {
+        size_t k = queries.empty() ? 0 : out.size() / queries.size();
+        for (size_t j = 0; j < queries.size(); ++j) counts[j] = findTopK(queries[j], out.subspan(j * k, k));
+    }
+
+    // Higher score wins; equal scores prefer the closer word length, then the earlier row
+    static bool isBetterMatch(double score, size_t length, double bestScore, size_t bestLength, size_t queryLength) {
+        if (score != bestScore) return score > bestScore;
+        return std::abs(static_cast<int>(length) - static_cast<int>(queryLength)) <
+               std::abs(static_cast<int>(bestLength) - static_cast<int>(queryLength));
+    }
+
+protected:
+    // Best row of a scan and its score; a fresh one loses to any real row
+    struct Match {
+        size_t row = 0;
+        double score = -1.0;
+    };
+
+    // Folds in the best of a later range; merging ranges in row order gives the
+    // same answer as one scan over all of them
+    static void mergeMatch(const EmbeddingStore& store, size_t queryLength, Match& into, const Match& later) {
+        if (isBetterMatch(later.score, store.word(later.row).size(), into.score,
+                          store.word(into.row).size(), queryLength)) {
+            into = later;
+        }
+    }
+
+    // Streams rows [first, last) through the dot-product kernel
+    static Match scanRange(const EmbeddingStore& store, const EmbeddingQuery& query, size_t first, size_t last) {
+        Match best{first, -1.0};
+        double scores[EmbeddingStore::SCORE_BLOCK];
+        for (size_t block = first; block < last; block += EmbeddingStore::SCORE_BLOCK) {
+            size_t n = std::min(EmbeddingStore::SCORE_BLOCK, last - block);
+            store.scoreRange(query, block, n, scores);
+            for (size_t k = 0; k < n; ++k) {
+                size_t i = block + k;
+                if (isBetterMatch(scores[k], store.word(i).size(), best.score,
+                                  store.word(best.row).size(), query.length)) {
+                    best = {i, scores[k]};
+                }
+            }
+        }
+        return best;
+    }
+
+    static std::optional<size_t> scanAll(const EmbeddingStore& store, const EmbeddingQuery& query) {
+        if (store.empty()) return std::nullopt;
+        VECTMO_METRICS_COUNT(CandidatesScored, store.size());
+        return scanRange(store, query, 0, store.size()).row;
+    }
+
+    // Matrix-matrix form of scanRange: each block of rows is scored against every
+    // query while it is still in cache, so the rows are streamed only once
+    static void scanRangeBatch(const EmbeddingStore& store, std::span<const EmbeddingQuery> queries,
+                               size_t first, size_t last, std::span<Match> best) {
+        std::fill(best.begin(), best.end(), Match{first, -1.0});
+        double scores[EmbeddingStore::SCORE_BLOCK];
+        for (size_t block = first; block < last; block += EmbeddingStore::SCORE_BLOCK) {
+            size_t n = std::min(EmbeddingStore::SCORE_BLOCK, last - block);
+            for (size_t j = 0; j < queries.size(); ++j) {
+                store.scoreRange(queries[j], block, n, scores);
+                for (size_t k = 0; k < n; ++k) {
+                    size_t i = block + k;
+                    if (isBetterMatch(scores[k], store.word(i).size(), best[j].score,
+                                      store.word(best[j].row).size(), queries[j].length)) {
+                        best[j] = {i, scores[k]};
+                    }
+                }
+            }
+        }
+    }
+
+    static void scanAllBatch(const EmbeddingStore& store, std::span<const EmbeddingQuery> queries,
+                             std::span<std::optional<size_t>> out) {
+        if (store.empty()) {
+            std::fill(out.begin(), out.end(), std::nullopt);
+            return;
+        }
+        VECTMO_METRICS_COUNT(CandidatesScored, store.size() * queries.size());
+
+        std::pmr::vector<Match> best(queries.size(), VectmoArena::scratch());
+        scanRangeBatch(store, queries, 0, store.size(), best);
+        for (size_t j = 0; j < queries.size(); ++j) out[j] = best[j].row;
+    }
+
+    // The best rows seen so far, kept as a heap in the caller's buffer with the
+    // worst on top, so once full most rows are turned away by one comparison
+    class TopK {
+    private:
+        std::span<Neighbor> heap;
+        size_t used = 0;
+        const EmbeddingStore* store;
+        size_t queryLength;
+
+        // Strict order: findNearest's ranking, then the earlier row
+        bool better(const Neighbor& a, const Neighbor& b) const {
+            size_t lengthA = store->word(a.row).size(), lengthB = store->word(b.row).size();
+            if (isBetterMatch(a.score, lengthA, b.score, lengthB, queryLength)) return true;
+            if (isBetterMatch(b.score, lengthB, a.score, lengthA, queryLength)) return false;
+            return a.row < b.row;
+        }
+
+        auto order() const {
+            return [this](const Neighbor& a, const Neighbor& b) { return better(a, b); };
+        }
+
+    public:
+        TopK(std::span<Neighbor> buffer, const EmbeddingStore& s, size_t length)
+            : heap(buffer), store(&s), queryLength(length) {}
+
+        bool full() const { return used == heap.size(); }
+        // A row scoring below this cannot get in
+        double threshold() const { return full() && used > 0 ? heap[0].score : -1.0; }
+
+        void offer(size_t row, double score) {
+            Neighbor entry{static_cast<uint32_t>(row), score};
+            if (!full()) {
+                heap[used++] = entry;
+                std::push_heap(heap.begin(), heap.begin() + used, order());
+                return;
+            }
+            if (used == 0 || score < heap[0].score || !better(entry, heap[0])) return;
+            std::pop_heap(heap.begin(), heap.begin() + used, order());
+            heap[used - 1] = entry;
+            std::push_heap(heap.begin(), heap.begin() + used, order());
+        }
+
+        void merge(std::span<const Neighbor> entries) {
+            for (const auto& entry : entries) offer(entry.row, entry.score);
+        }
+
+        // Sorts the buffer best first and returns the entry count
+        size_t finish() {
+            std::sort_heap(heap.begin(), heap.begin() + used, order());
+            return used;
+        }
+    };
+
+    static void scanRangeTopK(const EmbeddingStore& store, const EmbeddingQuery& query, size_t first, size_t last,
+                              TopK& top) {
+        double scores[EmbeddingStore::SCORE_BLOCK];
+        for (size_t block = first; block < last; block += EmbeddingStore::SCORE_BLOCK) {
+            size_t n = std::min(EmbeddingStore::SCORE_BLOCK, last - block);
+            store.scoreRange(query, block, n, scores);
+            for (size_t k = 0; k < n; ++k) {
+                if (scores[k] >= top.threshold()) top.offer(block + k, scores[k]);
+            }
+        }
+    }
+
+    // Like scanRangeBatch: every block is scored against all queries while cached
+    static void scanRangeTopKBatch(const EmbeddingStore& store, std::span<const EmbeddingQuery> queries,
+                                   size_t first, size_t last, std::span<TopK> tops) {
+        double scores[EmbeddingStore::SCORE_BLOCK];
+        for (size_t block = first; block < last; block += EmbeddingStore::SCORE_BLOCK) {
+            size_t n = std::min(EmbeddingStore::SCORE_BLOCK, last - block);
+            for (size_t j = 0; j < queries.size(); ++j) {
+                store.scoreRange(queries[j], block, n, scores);
+                TopK& top = tops[j];
+                for (size_t k = 0; k < n; ++k) {
+                    if (scores[k] >= top.threshold()) top.offer(block + k, scores[k]);
+                }
+            }
+        }
+    }
+
+    static size_t scanAllTopK(const EmbeddingStore& store, const EmbeddingQuery& query, std::span<Neighbor> out) {
+        VECTMO_METRICS_COUNT(CandidatesScored, store.size());
+        TopK top(out, store, query.length);
+        scanRangeTopK(store, query, 0, store.size(), top);
+        return top.finish();
+    }
+
+    static void scanAllTopKBatch(const EmbeddingStore& store, std::span<const EmbeddingQuery> queries,
+                                 std::span<Neighbor> out, std::span<size_t> counts) {
+        VECTMO_METRICS_COUNT(CandidatesScored, store.size() * queries.size());
+        size_t k = queries.empty() ? 0 : out.size() / queries.size();
+        std::pmr::vector<TopK> tops(VectmoArena::scratch());
+        tops.reserve(queries.size());
+        for (size_t j = 0; j < queries.size(); ++j) tops.emplace_back(out.subspan(j * k, k), store, queries[j].length);
+        scanRangeTopKBatch(store, queries, 0, store.size(), tops);
+        for (size_t j = 0; j < queries.size(); ++j) counts[j] = tops[j].finish();
+    }
+};
+
+// Exact search: scores every vocabulary word. Given a pool, stores of at least
+// parallelThreshold rows are split into chunks scored concurrently; each chunk's
+// best is merged in row order, so the answer is the same as the serial scan.
+// A store with deferred rows still to fill is split at any size, since each
+// chunk fills its own rows as it scores them.
+class ExactScanIndex : public SimilarityIndex {
+public:
+    static constexpr size_t PARALLEL_THRESHOLD = 1 << 16;
+    // Chunks stay big enough that dispatch is noise next to the scoring
+    static constexpr size_t MIN_CHUNK_ROWS = 1 << 13;
+
+private:
+    const EmbeddingStore* store = nullptr;
+    std::shared_ptr<VectmoThreads::WorkStealingPool> pool;
+    size_t parallelThreshold = PARALLEL_THRESHOLD;
+
+    // A few chunks per participating thread lets stealing even out stragglers
+    size_t chunkCount() const {
+        if (!pool || pool->workerCount() == 0) return 1;
+        if (store->size() < parallelThreshold && store->isMaterialized()) return 1;
+        size_t byThreads = (pool->workerCount() + 1) * 4;
+        size_t bySize = std::max<size_t>(store->size() / MIN_CHUNK_ROWS, 1);
+        return std::min(byThreads, bySize);
+    }
+
+    // Chunk boundaries fall on SCORE_BLOCK multiples so kernels see full blocks
+    std::pair<size_t, size_t> chunkRange(size_t c, size_t chunks) const {
+        size_t blocks = (store->size() + EmbeddingStore::SCORE_BLOCK - 1) / EmbeddingStore::SCORE_BLOCK;
+        size_t first = blocks * c / chunks * EmbeddingStore::SCORE_BLOCK;
+        size_t last = std::min(blocks * (c + 1) / chunks * EmbeddingStore::SCORE_BLOCK, store->size());
+        return {first, last};
+    }
+
+public:
+    ExactScanIndex() = default;
+    explicit ExactScanIndex(std::shared_ptr<VectmoThreads::WorkStealingPool> searchPool,
+                            size_t threshold = PARALLEL_THRESHOLD)
+        : pool(std::move(searchPool)), parallelThreshold(threshold) {}
+
+    void build(const EmbeddingStore& s) override { store = &s; }
+
+    std::optional<size_t> findNearest(const EmbeddingQuery& query) const override {
+        if (!store) return std::nullopt;
+        size_t chunks = chunkCount();
+        if (chunks == 1) return scanAll(*store, query);
+
+        VECTMO_METRICS_COUNT(CandidatesScored, store->size());
+        std::pmr::vector<Match> best(chunks, VectmoArena::scratch());
+        pool->parallelFor(chunks, [&](size_t c) {
+            auto [first, last] = chunkRange(c, chunks);
+            if (first < last) best[c] = scanRange(*store, query, first, last);
+        });
+        Match result = best[0];
+        for (size_t c = 1; c < chunks; ++c) {
+            if (best[c].score >= 0.0) mergeMatch(*store, query.length, result, best[c]);
+        }
+        return result.row;
+    }
+
+    void findNearestBatch(std::span<const EmbeddingQuery> queries,
+                          std::span<std::optional<size_t>> out) const override {
+        if (!store) {
+            std::fill(out.begin(), out.end(), std::nullopt);
+            return;
+        }
+        size_t chunks = chunkCount();
+        if (chunks == 1 || queries.empty()) {
+            scanAllBatch(*store, queries, out);
+            return;
+        }
+
+        VECTMO_METRICS_COUNT(CandidatesScored, store->size() * queries.size());
+        // Chunk c's best for query j is best[c * queries + j]
+        size_t n = queries.size();
+        std::pmr::vector<Match> best(chunks * n, VectmoArena::scratch());
+        pool->parallelFor(chunks, [&](size_t c) {
+            auto [first, last] = chunkRange(c, chunks);
+            if (first < last) scanRangeBatch(*store, queries, first, last, std::span<Match>(best).subspan(c * n, n));
+        });
+        for (size_t j = 0; j < n; ++j) {
+            Match result = best[j];
+            for (size_t c = 1; c < chunks; ++c) {
+                const Match& match = best[c * n + j];
+                if (match.score >= 0.0) mergeMatch(*store, queries[j].length, result, match);
+            }
+            out[j] = result.row;
+        }
+    }
+
+    // Chunks keep their own k best; the order is total, so merging them in any
+    // order gives the serial scan's answer
+    size_t findTopK(const EmbeddingQuery& query, std::span<Neighbor> out) const override {
+        if (!store || store->empty() || out.empty()) return 0;
+        size_t chunks = chunkCount();
+        if (chunks == 1) return scanAllTopK(*store, query, out);
+
+        VECTMO_METRICS_COUNT(CandidatesScored, store->size());
+        size_t k = out.size();
+        std::pmr::vector<Neighbor> partial(chunks * k, VectmoArena::scratch());
+        std::pmr::vector<size_t> found(chunks, 0, VectmoArena::scratch());
+        pool->parallelFor(chunks, [&](size_t c) {
+            auto [first, last] = chunkRange(c, chunks);
+            TopK top(std::span<Neighbor>(partial).subspan(c * k, k), *store, query.length);
+            scanRangeTopK(*store, query, first, last, top);
+            found[c] = top.finish();
+        });
+        TopK top(out, *store, query.length);
+        for (size_t c = 0; c < chunks; ++c) top.merge(std::span<const Neighbor>(partial).subspan(c * k, found[c]));
+        return top.finish();
+    }
+
+    void findTopKBatch(std::span<const EmbeddingQuery> queries, std::span<Neighbor> out,
+                       std::span<size_t> counts) const override {
+        size_t k = queries.empty() ? 0 : out.size() / queries.size();
+        if (!store || store->empty() || k == 0) {
+            std::fill(counts.begin(), counts.end(), 0);
+            return;
+        }
+        size_t chunks = chunkCount();
+        if (chunks == 1) {
+            scanAllTopKBatch(*store, queries, out, counts);
+            return;
+        }
+
+        VECTMO_METRICS_COUNT(CandidatesScored, store->size() * queries.size());
+        // Chunk c's entries for query j start at ((c * queries) + j) * k; its
+        // heaps are laid out here too, since workers have no arena of their own
+        size_t perChunk = queries.size() * k;
+        std::pmr::memory_resource* scratch = VectmoArena::scratch();
+        std::pmr::vector<Neighbor> partial(chunks * perChunk, scratch);
+        std::pmr::vector<size_t> found(chunks * queries.size(), 0, scratch);
+        std::pmr::vector<TopK> tops(scratch);
+        tops.reserve(chunks * queries.size());
+        for (size_t c = 0; c < chunks; ++c) {
+            for (size_t j = 0; j < queries.size(); ++j) {
+                tops.emplace_back(std::span<Neighbor>(partial).subspan(c * perChunk + j * k, k), *store,
+                                  queries[j].length);
+            }
+        }
+        pool->parallelFor(chunks, [&](size_t c) {
+            auto [first, last] = chunkRange(c, chunks);
+            auto chunkTops = std::span<TopK>(tops).subspan(c * queries.size(), queries.size());
+            scanRangeTopKBatch(*store, queries, first, last, chunkTops);
+            for (size_t j = 0; j < queries.size(); ++j) found[c * queries.size() + j] = chunkTops[j].finish();
+        });
+        for (size_t j = 0; j < queries.size(); ++j) {
+            TopK top(out.subspan(j * k, k), *store, queries[j].length);
+            for (size_t c = 0; c < chunks; ++c) {
+                top.merge(std::span<const Neighbor>(partial).subspan(c * perChunk + j * k,
+                                                                     found[c * queries.size() + j]));
+            }
+            counts[j] = top.finish();
+        }
+    }
+};
+
+// Exact search that skips words which provably cannot win. Words are grouped by
+// (length, character count, largest count, squared norm); for non-negative counts
+// q.r <= min(max(q) * sum(r), sum(q) * max(r)), which bounds the cosine of a whole
+// group. Groups are visited best bound first and the scan stops once no remaining
+// group can reach the current best score. Inside a group, q.r <= max(q) * max(r) *
+// (shared characters) skips rows from their presence mask alone. The result
+// matches ExactScanIndex.
+class NormBoundIndex : public SimilarityIndex {
+private:
+    struct Group {
+        size_t length;
+        uint32_t total;
+        uint32_t maxCount;
+        double inverseNorm;
+        std::vector<uint32_t> rows;  // ascending, so ties inside a group resolve like the full scan
+        std::vector<CharPresenceMask> masks;  // parallel to rows, contiguous for the filter pass
+    };
+
+    const EmbeddingStore* store = nullptr;
+    std::vector<Group> groups;
+
+    // Keeps the scan's ordering: higher score, then closer length, then earlier row
+    struct Best {
+        double score = -1.0;
+        size_t row = 0;
+        size_t distance = 0;
+        bool found = false;
+
+        void offer(double score_, size_t row_, size_t distance_) {
+            if (found && (score_ < score || (score_ == score && (distance_ > distance ||
+                                                                  (distance_ == distance && row_ > row))))) {
+                return;
+            }
+            score = score_;
+            row = row_;
+            distance = distance_;
+            found = true;
+        }
+    };
+
+public:
+    // Groups by every row's counts, so deferred rows are filled up front
+    void build(const EmbeddingStore& s) override {
+        s.materializeAll();
+        store = &s;
+        groups.clear();
+
+        std::map<std::tuple<size_t, uint32_t, uint32_t, uint64_t>, size_t> slots;
+        for (size_t i = 0; i < s.size(); ++i) {
+            uint32_t total = 0, maxCount = 0;
+            uint64_t sumSquares = 0;
+            for (size_t c = 0; c < CharIndexMap::VOCAB_SIZE; ++c) {
+                uint32_t n = s.charCount(i, c);
+                total += n;
+                maxCount = std::max(maxCount, n);
+                sumSquares += uint64_t{n} * n;
+            }
+            auto key = std::make_tuple(s.word(i).size(), total, maxCount, sumSquares);
+            auto [it, inserted] = slots.try_emplace(key, groups.size());
+            if (inserted) groups.push_back({s.word(i).size(), total, maxCount, s.inverseNorm(i), {}, {}});
+            groups[it->second].rows.push_back(static_cast<uint32_t>(i));
+            groups[it->second].masks.push_back(s.mask(i));
+        }
+    }
+
+private:
+    // Slack covers rounding between the bound and the kernel's score
+    static constexpr double BOUND_SLACK = 1e-9;
+
+    struct Visit {
+        double bound;
+        size_t distance;
+        const Group* group;
+    };
+
+    // Groups best bound first; queryMax is the query's largest count
+    std::vector<Visit> visitOrder(const EmbeddingQuery& query, double& queryMax) const {
+        // Bound with the query values the store actually scores against
+        double queryTotal = 0.0;
+        queryMax = 0.0;
+        for (size_t c = 0; c < CharIndexMap::VOCAB_SIZE; ++c) {
+            double v = store->getPrecision() == EmbeddingPrecision::Uint8 ? query.compactRow[c] : query.row[c];
+            queryTotal += v;
+            queryMax = std::max(queryMax, v);
+        }
+
+        std::vector<Visit> order;
+        order.reserve(groups.size());
+        for (const auto& g : groups) {
+            double bound = std::min(queryMax * g.total, queryTotal * g.maxCount) * g.inverseNorm *
+                           query.inverseNormFor(store->getPrecision());
+            size_t distance = g.length > query.length ? g.length - query.length : query.length - g.length;
+            order.push_back({bound, distance, &g});
+        }
+        std::sort(order.begin(), order.end(), [](const Visit& a, const Visit& b) {
+            return a.bound != b.bound ? a.bound > b.bound : a.distance < b.distance;
+        });
+        return order;
+    }
+
+public:
+    std::optional<size_t> findNearest(const EmbeddingQuery& query) const override {
+        if (!store || store->empty()) return std::nullopt;
+
+        double queryMax;
+        auto order = visitOrder(query, queryMax);
+        Best best;
+        for (const auto& visit : order) {
+            if (best.found && visit.bound * (1.0 + BOUND_SLACK) < best.score) break;
+            const Group& g = *visit.group;
+            if (visit.bound == 0.0) {
+                // Every word in the group scores exactly 0; its first row is the only contender
+                best.offer(0.0, g.rows.front(), visit.distance);
+                continue;
+            }
+
+            double perShared = queryMax * g.maxCount * g.inverseNorm * query.inverseNormFor(store->getPrecision()) *
+                               (1.0 + BOUND_SLACK);
+            for (size_t k = 0; k < g.rows.size(); ++k) {
+                int shared = g.masks[k].sharedCount(query.mask);
+                if (best.found && shared * perShared < best.score) continue;
+                double score;
+                store->scoreRows(query, &g.rows[k], 1, &score);
+                VECTMO_METRICS_COUNT(CandidatesScored, 1);
+                best.offer(score, g.rows[k], visit.distance);
+            }
+        }
+        return best.row;
+    }
+
+    // The same walk, stopping once no group can reach the k-th best
+    size_t findTopK(const EmbeddingQuery& query, std::span<Neighbor> out) const override {
+        if (!store || store->empty() || out.empty()) return 0;
+
+        double queryMax;
+        auto order = visitOrder(query, queryMax);
+        TopK top(out, *store, query.length);
+        for (const auto& visit : order) {
+            if (top.full() && visit.bound * (1.0 + BOUND_SLACK) < top.threshold()) break;
+            const Group& g = *visit.group;
+            if (visit.bound == 0.0) {
+                // Every word in the group scores exactly 0; its first k rows are the only contenders
+                for (size_t k = 0; k < std::min(g.rows.size(), out.size()); ++k) top.offer(g.rows[k], 0.0);
+                continue;
+            }
+
+            double perShared = queryMax * g.maxCount * g.inverseNorm * query.inverseNormFor(store->getPrecision()) *
+                               (1.0 + BOUND_SLACK);
+            for (size_t k = 0; k < g.rows.size(); ++k) {
+                int shared = g.masks[k].sharedCount(query.mask);
+                if (top.full() && shared * perShared < top.threshold()) continue;
+                double score;
+                store->scoreRows(query, &g.rows[k], 1, &score);
+                VECTMO_METRICS_COUNT(CandidatesScored, 1);
+                top.offer(g.rows[k], score);
+            }
+        }
+        return top.finish();
+    }
+};
+
+// Approximate search: inverted lists keyed on character buckets.
+// Only words sharing one of the query's `probes` rarest characters are scored;
+// more probes trade latency for recall, and probes <= 0 scans every shared character.
+class CharBucketIndex : public SimilarityIndex {
+private:
+    const EmbeddingStore* store = nullptr;
+    std::array<std::vector<uint32_t>, CharIndexMap::VOCAB_SIZE> postings;
+    int probes;
+
+public:
+    explicit CharBucketIndex(int probeCount = 2) : probes(probeCount) {}
+
+    // Posting lists come from every row, so deferred rows are filled up front
+    void build(const EmbeddingStore& s) override {
+        s.materializeAll();
+        store = &s;
+        for (auto& list : postings) list.clear();
+
+        for (size_t i = 0; i < s.size(); ++i) {
+            for (int c = 0; c < CharIndexMap::VOCAB_SIZE; ++c) {
+                if (s.charCount(i, c) > 0) postings[c].push_back(static_cast<uint32_t>(i));
+            }
+        }
+    }
+
+private:
+    // Rows sharing one of the probed buckets, ascending; false when the query
+    // shares no character with any word
+    bool gatherCandidates(const EmbeddingQuery& query, std::vector<uint32_t>& candidates) const {
+        std::vector<int> buckets;
+        for (int c = 0; c < CharIndexMap::VOCAB_SIZE; ++c) {
+            if (query.row[c] > 0.0f && !postings[c].empty()) buckets.push_back(c);
+        }
+        if (buckets.empty()) return false;
+
+        std::sort(buckets.begin(), buckets.end(), [&](int a, int b) {
+            return postings[a].size() < postings[b].size();
+        });
+        if (probes > 0 && buckets.size() > static_cast<size_t>(probes)) buckets.resize(probes);
+
+        for (int c : buckets) {
+            candidates.insert(candidates.end(), postings[c].begin(), postings[c].end());
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        VECTMO_METRICS_COUNT(CandidatesScored, candidates.size());
+        return true;
+    }
+
+public:
+    std::optional<size_t> findNearest(const EmbeddingQuery& query) const override {
+        if (!store || store->empty()) return std::nullopt;
+
+        std::vector<uint32_t> candidates;
+        // Nothing shared with any word: every score is 0, so defer to the exact tie-break
+        if (!gatherCandidates(query, candidates)) return scanAll(*store, query);
+
+        size_t best = candidates.front();
+        double bestScore = -1.0;
+        for (uint32_t i : candidates) {
+            double score = store->score(query, i);
+            if (isBetterMatch(score, store->word(i).size(), bestScore,
+                              store->word(best).size(), query.length)) {
+                bestScore = score;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // The k best of the same candidates, so just as approximate as findNearest
+    size_t findTopK(const EmbeddingQuery& query, std::span<Neighbor> out) const override {
+        if (!store || store->empty() || out.empty()) return 0;
+
+        std::vector<uint32_t> candidates;
+        if (!gatherCandidates(query, candidates)) return scanAllTopK(*store, query, out);
+
+        TopK top(out, *store, query.length);
+        for (uint32_t i : candidates) {
+            double score = store->score(query, i);
+            if (score >= top.threshold()) top.offer(i, score);
+        }
+        return top.finish();
+    }
+};
+
+// The store's words, which are sorted, viewed as an implicit trie: a node is
+// the row range sharing a prefix, and a child's range is a binary search on the
+// next byte within it. The two widest levels are precomputed in one pass.
+// Holds the store by reference; rebuild it whenever the store changes.
+class VocabularyPrefixIndex {
+public:
+    struct Node {
+        uint32_t lo = 0;
+        uint32_t hi = 0;
+        uint32_t depth = 0;
+
+        bool empty() const { return lo == hi; }
+    };
+
+private:
+    static constexpr size_t FANOUT = 256;
+
+    const EmbeddingStore& store;
+    std::vector<uint32_t> firstLevel;   // FANOUT + 1 row bounds by first byte
+    std::vector<uint32_t> secondLevel;  // FANOUT + 1 bounds per first byte, second byte
+    size_t longest = 0;
+
+    static size_t byteAt(std::string_view word, size_t i) { return static_cast<unsigned char>(word[i]); }
+
+public:
+    explicit VocabularyPrefixIndex(const EmbeddingStore& embeddings)
+        : store(embeddings), firstLevel(FANOUT + 1, 0), secondLevel(FANOUT * (FANOUT + 1), 0) {
+        // Counts first, then prefix sums into absolute row bounds
+        std::vector<uint32_t> single(FANOUT, 0);
+        for (size_t i = 0; i < store.size(); ++i) {
+            std::string_view word = store.word(i);
+            if (word.empty()) continue;
+            longest = std::max(longest, word.size());
+            ++firstLevel[byteAt(word, 0) + 1];
+            if (word.size() == 1) {
+                ++single[byteAt(word, 0)];
+            } else {
+                ++secondLevel[byteAt(word, 0) * (FANOUT + 1) + byteAt(word, 1) + 1];
+            }
+        }
+        // Empty words sort first; none are interned, but stay exact if one is
+        firstLevel[0] = static_cast<uint32_t>(store.size()) - std::accumulate(firstLevel.begin() + 1, firstLevel.end(), 0u);
+        for (size_t a = 0; a < FANOUT; ++a) firstLevel[a + 1] += firstLevel[a];
+        for (size_t a = 0; a < FANOUT; ++a) {
+            uint32_t* bounds = secondLevel.data() + a * (FANOUT + 1);
+            bounds[0] = firstLevel[a] + single[a];
+            for (size_t b = 0; b < FANOUT; ++b) bounds[b + 1] += bounds[b];
+        }
+    }
+
+    Node root() const { return {0, static_cast<uint32_t>(store.size()), 0}; }
+
+    // Range of words continuing the node's prefix with c; empty if there are none
+    Node child(Node node, char c) const {
+        size_t next = static_cast<unsigned char>(c);
+        if (node.empty()) return node;
+        if (node.depth == 0) return {firstLevel[next], firstLevel[next + 1], 1};
+        if (node.depth == 1) {
+            const uint32_t* bounds = secondLevel.data() + byteAt(store.word(node.lo), 0) * (FANOUT + 1);
+            return {bounds[next], bounds[next + 1], 2};
+        }
+        // Only the first row can end at this depth, and it sorts before the rest
+        uint32_t lo = node.lo + (store.word(node.lo).size() == node.depth ? 1 : 0);
+        auto byteBelow = [&](uint32_t row, size_t value) { return byteAt(store.word(row), node.depth) < value; };
+        uint32_t first = lo, last = node.hi;
+        while (first < last) {
+            uint32_t mid = first + (last - first) / 2;
+            if (byteBelow(mid, next)) first = mid + 1; else last = mid;
+        }
+        uint32_t end = node.hi;
+        last = first;
+        while (last < end) {
+            uint32_t mid = last + (end - last) / 2;
+            if (byteBelow(mid, next + 1)) last = mid + 1; else end = mid;
+        }
+        return {first, last, node.depth + 1};
+    }
+
+    // Row of the word that is exactly the node's prefix, if any
+    std::optional<uint32_t> word(Node node) const {
+        if (node.empty() || node.depth == 0 || store.word(node.lo).size() != node.depth) return std::nullopt;
+        return node.lo;
+    }
+
+    std::string_view spelling(size_t row) const { return store.word(row); }
+    size_t longestWord() const { return longest; }
+};
+
+// Shape of the distribution sampled generation draws from. Followers are ranked
+// by count; temperature reweights them as count^(1/T), then top-k and top-p
+// truncate the ranking. Temperature <= 0 keeps only the top follower.
+struct SamplingOptions {
+    double temperature = 1.0;
+    int topK = 0;        // 0 keeps every follower
+    double topP = 1.0;   // smallest prefix holding this much probability mass
+
+    // Fills weights for followers whose counts are sorted descending; truncated
+    // followers get weight 0. Weights are relative to the top follower.
+    template <typename Count>
+    void shape(std::span<const Count> counts, std::vector<double>& weights) const {
+        weights.assign(counts.size(), 0.0);
+        if (counts.empty()) return;
+        size_t keep = counts.size();
+        if (temperature <= 0.0) keep = 1;
+        if (topK > 0) keep = std::min(keep, static_cast<size_t>(topK));
+
+        double top = std::log(static_cast<double>(counts[0]));
+        double total = 0.0;
+        for (size_t i = 0; i < keep; ++i) {
+            weights[i] = keep == 1 ? 1.0 : std::exp((std::log(static_cast<double>(counts[i])) - top) / temperature);
+            total += weights[i];
+        }
+        if (topP < 1.0) {
+            double mass = 0.0;
+            size_t i = 0;
+            while (i < keep && mass < topP * total) mass += weights[i++];
+            std::fill(weights.begin() + std::max<size_t>(i, 1), weights.begin() + keep, 0.0);
+        }
+    }
+};
+
+// xoshiro256** seeded through splitmix64. Each generation owns one, so draws
+// need no locking and a given seed always replays the same text.
+class VectmoRandom {
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    explicit VectmoRandom(uint64_t seed) {
+        for (auto& word : state) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, 1) from the top 53 bits
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+};
+
+// Walker alias tables for many small distributions stored back to back; a draw
+// is one random number, one multiply and one compare. Runs are at most 256
+// entries, the largest alphabet.
+class AliasTable {
+private:
+    static constexpr size_t MAX_RUN = 256;
+
+    std::vector<uint32_t> thresholds;  // keep entry i if the low 32 random bits are below this
+    std::vector<uint8_t> aliases;      // otherwise take this entry; full entries alias themselves
+
+public:
+    void resize(size_t entries) {
+        thresholds.assign(entries, 0);
+        aliases.assign(entries, 0);
+    }
+
+    // Lays out the alias run over weights at [offset, offset + weights.size());
+    // an all-zero run is left empty and must not be drawn from. Runs at
+    // different offsets may be built concurrently
+    void build(size_t offset, std::span<const double> weights) {
+        size_t n = weights.size();
+        double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+        if (n == 0 || total <= 0.0) return;
+
+        std::array<double, MAX_RUN> scaled;
+        std::array<uint8_t, MAX_RUN> small, large;
+        size_t smallCount = 0, largeCount = 0;
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = weights[i] * static_cast<double>(n) / total;
+            if (scaled[i] < 1.0) small[smallCount++] = static_cast<uint8_t>(i);
+            else large[largeCount++] = static_cast<uint8_t>(i);
+        }
+        while (smallCount > 0 && largeCount > 0) {
+            size_t s = small[--smallCount], l = large[largeCount - 1];
+            thresholds[offset + s] = static_cast<uint32_t>(scaled[s] * 4294967296.0);
+            aliases[offset + s] = static_cast<uint8_t>(l);
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                --largeCount;
+                small[smallCount++] = static_cast<uint8_t>(l);
+            }
+        }
+        // Whatever is left is full up to rounding
+        for (size_t k = 0; k < smallCount; ++k) {
+            thresholds[offset + small[k]] = UINT32_MAX;
+            aliases[offset + small[k]] = small[k];
+        }
+        for (size_t k = 0; k < largeCount; ++k) {
+            thresholds[offset + large[k]] = UINT32_MAX;
+            aliases[offset + large[k]] = large[k];
+        }
+    }
+
+    size_t draw(size_t offset, size_t n, VectmoRandom& rng) const {
+        uint64_t r = rng.next();
+        size_t i = static_cast<size_t>(((r >> 32) * n) >> 32);
+        return static_cast<uint32_t>(r) < thresholds[offset + i] ? i : aliases[offset + i];
+    }
+
+    // The distribution the run was built from, read back as n times the chance
+    // draw() returns each entry; entries given weight 0 come out exactly 0
+    void weights(size_t offset, size_t n, std::span<double> out) const {
+        std::fill(out.begin(), out.begin() + n, 0.0);
+        for (size_t i = 0; i < n; ++i) {
+            double keep = thresholds[offset + i] / 4294967296.0;
+            out[i] += keep;
+            out[aliases[offset + i]] += 1.0 - keep;
+        }
+    }
+};
+
+// Higher-order character contexts (trigram up to 6-gram) for generation with
+// backoff. Counts live in a flat open-addressing table keyed on the packed
+// (context, next) pair; finalize() lays out a second flat table from packed
+// context to a run of followers, pre-sorted like the bigram rows. Contexts are
+// the supported-char indices of the newest chars, BITS each (7 for the default
+// alphabet), so one key is a single 64-bit compare and a lookup is usually one
+// cache line.
+class NgramModel {
+public:
+    static constexpr int MIN_ORDER = 2;  // order 2 is the plain bigram table
+    static constexpr int MAX_ORDER = 6;
+    static constexpr int MAX_CONTEXT = MAX_ORDER - 1;
+
+    // Newest chars of the text seen so far, carried across stream buffers
+    struct History {
+        uint64_t packed = 0;
+        int length = 0;
+
+        void push(int idx) {
+            if (idx == CharIndexMap::INVALID_INDEX) {
+                packed = 0;
+                length = 0;
+                return;
+            }
+            packed = ((packed << BITS) | static_cast<uint64_t>(idx + 1)) & ((1ULL << (BITS * MAX_CONTEXT)) - 1);
+            length = std::min(length + 1, MAX_CONTEXT);
+        }
+    };
+
+private:
+    static constexpr int BITS = std::bit_width(static_cast<unsigned>(CharIndexMap::VOCAB_SIZE));
+    static constexpr int LENGTH_SHIFT = 40;
+    static constexpr int NEXT_SHIFT = 48;
+    static_assert(BITS * MAX_CONTEXT <= LENGTH_SHIFT && NEXT_SHIFT + BITS <= 64, "pair keys fit 64 bits");
+
+    struct CountSlot {
+        uint64_t key = 0;
+        uint64_t count = 0;
+    };
+
+    struct ContextSlot {
+        uint64_t key = 0;
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+
+    int order = MIN_ORDER;
+    std::vector<CountSlot> counts;
+    size_t countsUsed = 0;
+    std::vector<ContextSlot> contexts;
+    std::vector<char> followerPool;
+    AliasTable followerAlias;  // parallel to followerPool
+
+    static size_t mix(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return static_cast<size_t>(key);
+    }
+
+    // The newest `length` chars of the history, tagged with their length
+    static uint64_t contextKey(uint64_t packed, int length) {
+        return (packed & ((1ULL << (BITS * length)) - 1)) | (static_cast<uint64_t>(length) << LENGTH_SHIFT);
+    }
+
+    void growCounts() {
+        std::vector<CountSlot> old(std::max<size_t>(counts.size() * 2, 1024));
+        old.swap(counts);
+        countsUsed = 0;
+        for (const auto& slot : old) {
+            if (slot.key != 0) addCount(slot.key, slot.count);
+        }
+    }
+
+public:
+    // 2 disables the higher-order tables; changing the order drops all counts
+    void setOrder(int n) {
+        order = std::clamp(n, MIN_ORDER, MAX_ORDER);
+        clear();
+    }
+    int getOrder() const { return order; }
+    bool enabled() const { return order > MIN_ORDER; }
+
+    void clear() {
+        counts.clear();
+        countsUsed = 0;
+        contexts.clear();
+        followerPool.clear();
+        followerAlias.resize(0);
+    }
+
+    void addCount(uint64_t pairKey, uint64_t n) {
+        if ((countsUsed + 1) * 2 > counts.size()) growCounts();
+        size_t mask = counts.size() - 1;
+        for (size_t i = mix(pairKey) & mask;; i = (i + 1) & mask) {
+            if (counts[i].key == pairKey) {
+                counts[i].count += n;
+                return;
+            }
+            if (counts[i].key == 0) {
+                counts[i] = {pairKey, n};
+                ++countsUsed;
+                return;
+            }
+        }
+    }
+
+    // Counts next (a supported-char index) after every tracked context length,
+    // then pushes it onto the history
+    void observe(History& history, int next) {
+        if (next != CharIndexMap::INVALID_INDEX) {
+            int longest = std::min(order - 1, history.length);
+            for (int length = 2; length <= longest; ++length) {
+                addCount(contextKey(history.packed, length) | (static_cast<uint64_t>(next + 1) << NEXT_SHIFT), 1);
+            }
+        }
+        history.push(next);
+    }
+
+    void observe(std::string_view text, History& history, const CharIndexMap& charMap) {
+        if (!enabled()) return;
+        for (char c : text) observe(history, charMap(c));
+    }
+
+    // Rebuilds the lookup table from the counts; followers of each context are
+    // ordered by descending count, ties by ascending character, and get an alias
+    // run shaped by sampling
+    void finalize(const CharIndexMap& charMap, const SamplingOptions& sampling = {}) {
+        contexts.clear();
+        followerPool.clear();
+        followerAlias.resize(0);
+        if (countsUsed == 0) return;
+
+        std::vector<CountSlot> pairs;
+        pairs.reserve(countsUsed);
+        for (const auto& slot : counts) {
+            if (slot.key != 0) pairs.push_back(slot);
+        }
+        const uint64_t contextMask = (1ULL << NEXT_SHIFT) - 1;
+        std::sort(pairs.begin(), pairs.end(), [&](const CountSlot& a, const CountSlot& b) {
+            uint64_t contextA = a.key & contextMask;
+            uint64_t contextB = b.key & contextMask;
+            if (contextA != contextB) return contextA < contextB;
+            if (a.count != b.count) return a.count > b.count;
+            return charMap[static_cast<int>(a.key >> NEXT_SHIFT) - 1] < charMap[static_cast<int>(b.key >> NEXT_SHIFT) - 1];
+        });
+
+        size_t distinct = 0;
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            if (i == 0 || (pairs[i].key & contextMask) != (pairs[i - 1].key & contextMask)) ++distinct;
+        }
+        size_t capacity = 16;
+        while (capacity < distinct * 2) capacity *= 2;
+        contexts.assign(capacity, ContextSlot{});
+        followerPool.reserve(pairs.size());
+        followerAlias.resize(pairs.size());
+
+        size_t mask = capacity - 1;
+        std::vector<uint64_t> runCounts;
+        std::vector<double> weights;
+        for (size_t i = 0; i < pairs.size();) {
+            uint64_t key = pairs[i].key & contextMask;
+            ContextSlot slot{key, static_cast<uint32_t>(followerPool.size()), 0};
+            runCounts.clear();
+            for (; i < pairs.size() && (pairs[i].key & contextMask) == key; ++i) {
+                followerPool.push_back(charMap[static_cast<int>(pairs[i].key >> NEXT_SHIFT) - 1]);
+                runCounts.push_back(pairs[i].count);
+                ++slot.length;
+            }
+            sampling.shape(std::span<const uint64_t>(runCounts), weights);
+            followerAlias.build(slot.offset, weights);
+            size_t at = mix(key) & mask;
+            while (contexts[at].key != 0) at = (at + 1) & mask;
+            contexts[at] = slot;
+        }
+    }
+
+    // Followers after the longest known context ending the history, backing off
+    // one char at a time; empty if no context of length >= 2 was seen
+    std::span<const char> followersAfter(std::string_view history, const CharIndexMap& charMap) const {
+        const ContextSlot* slot = findContext(history, charMap);
+        if (!slot) return {};
+        return std::span<const char>(followerPool.data() + slot->offset, slot->length);
+    }
+
+    // One follower of the same context followersAfter picks, drawn from the
+    // distribution finalize() was given; '\0' if no context matches
+    char sampleAfter(std::string_view history, const CharIndexMap& charMap, VectmoRandom& rng) const {
+        const ContextSlot* slot = findContext(history, charMap);
+        if (!slot) return '\0';
+        return followerPool[slot->offset + followerAlias.draw(slot->offset, slot->length, rng)];
+    }
+
+    // Followers of the context sampleAfter draws from, with their relative
+    // chances in weights; empty if no context matches
+    std::span<const char> weightsAfter(std::string_view history, const CharIndexMap& charMap,
+                                       std::span<double> weights) const {
+        const ContextSlot* slot = findContext(history, charMap);
+        if (!slot) return {};
+        followerAlias.weights(slot->offset, slot->length, weights);
+        return std::span<const char>(followerPool.data() + slot->offset, slot->length);
+    }
+
+private:
+    const ContextSlot* findContext(std::string_view history, const CharIndexMap& charMap) const {
+        if (contexts.empty()) return nullptr;
+
+        uint64_t packed = 0;
+        int length = 0;
+        int longest = std::min<int>(order - 1, static_cast<int>(history.size()));
+        while (length < longest) {
+            int idx = charMap(history[history.size() - 1 - length]);
+            if (idx == CharIndexMap::INVALID_INDEX) break;
+            packed |= static_cast<uint64_t>(idx + 1) << (BITS * length);
+            ++length;
+        }
+
+        size_t mask = contexts.size() - 1;
+        for (; length >= 2; --length) {
+            uint64_t key = contextKey(packed, length);
+            for (size_t i = mix(key) & mask; contexts[i].key != 0; i = (i + 1) & mask) {
+                if (contexts[i].key == key) return &contexts[i];
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    // Raw (pairKey, count) entries, as persisted by the model files
+    template <typename Fn>
+    void forEachCount(Fn&& fn) const {
+        for (const auto& slot : counts) {
+            if (slot.key != 0) fn(slot.key, slot.count);
+        }
+    }
+
+    // Splits a pair key into its context indices (oldest first) and the next index
+    static std::pair<std::vector<int>, int> decodePair(uint64_t pairKey) {
+        int length = static_cast<int>((pairKey >> LENGTH_SHIFT) & 0xff);
+        std::vector<int> context(length);
+        for (int i = 0; i < length; ++i) {
+            context[length - 1 - i] = static_cast<int>((pairKey >> (BITS * i)) & ((1ULL << BITS) - 1)) - 1;
+        }
+        return {context, static_cast<int>(pairKey >> NEXT_SHIFT) - 1};
+    }
+
+    // Inverse of decodePair; 0 if the context is not a valid length or index
+    static uint64_t encodePair(const std::vector<int>& context, int next) {
+        int length = static_cast<int>(context.size());
+        if (length < 2 || length > MAX_CONTEXT || next < 0 || next >= CharIndexMap::VOCAB_SIZE) return 0;
+        uint64_t packed = 0;
+        for (int i = 0; i < length; ++i) {
+            int idx = context[length - 1 - i];
+            if (idx < 0 || idx >= CharIndexMap::VOCAB_SIZE) return 0;
+            packed |= static_cast<uint64_t>(idx + 1) << (BITS * i);
+        }
+        return contextKey(packed, length) | (static_cast<uint64_t>(next + 1) << NEXT_SHIFT);
+    }
+
+    size_t pairCount() const { return countsUsed; }
+};
+
+// Bounded, thread-safe cache of raw token -> row of the snapped word. Greedy
+// generation repeats the same tokens constantly, so most snaps never reach the
+// index, and a hit copies no strings. A remote vocabulary has no local rows, so
+// its entries hold the snapped word itself.
+// Entries are split across independently locked shards, each evicting with CLOCK.
+class SnapCache {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct Entry {
+        std::string key;
+        size_t row = 0;
+        std::string word;  // remote entries only
+        bool referenced = false;
+    };
+
+    // Lets lookups probe with a string_view without building a key string
+    struct KeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, size_t, KeyHash, std::equal_to<>> slotByKey;
+        std::vector<Entry> entries;
+        size_t hand = 0;
+        size_t capacity = 0;
+    };
+
+    std::array<Shard, SHARD_COUNT> shards;
+    std::atomic<size_t> capacity{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    Shard& shardFor(std::string_view key) {
+        return shards[KeyHash{}(key) % SHARD_COUNT];
+    }
+
+    // Caller holds shard.mutex
+    Entry* find(Shard& shard, std::string_view key) {
+        auto it = shard.slotByKey.find(key);
+        if (it == shard.slotByKey.end()) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            VECTMO_METRICS_COUNT(CacheMisses, 1);
+            return nullptr;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        VECTMO_METRICS_COUNT(CacheHits, 1);
+        Entry& entry = shard.entries[it->second];
+        entry.referenced = true;
+        return &entry;
+    }
+
+    void place(std::string_view key, size_t row, std::string_view word) {
+        if (capacity == 0) return;
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.capacity == 0 || shard.slotByKey.find(key) != shard.slotByKey.end()) return;
+
+        if (shard.entries.size() < shard.capacity) {
+            shard.slotByKey.emplace(key, shard.entries.size());
+            shard.entries.push_back({std::string(key), row, std::string(word), false});
+            return;
+        }
+
+        // CLOCK: clear reference bits until an unreferenced victim comes round
+        while (shard.entries[shard.hand].referenced) {
+            shard.entries[shard.hand].referenced = false;
+            shard.hand = (shard.hand + 1) % shard.entries.size();
+        }
+        Entry& victim = shard.entries[shard.hand];
+        shard.slotByKey.erase(victim.key);
+        victim = {std::string(key), row, std::string(word), false};
+        shard.slotByKey.emplace(key, shard.hand);
+        shard.hand = (shard.hand + 1) % shard.entries.size();
+    }
+
+public:
+    explicit SnapCache(size_t maxEntries = DEFAULT_CAPACITY) { setCapacity(maxEntries); }
+
+    // 0 disables caching; resizing drops every entry
+    void setCapacity(size_t maxEntries) {
+        clear();
+        capacity = maxEntries;
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            shards[i].capacity = maxEntries / SHARD_COUNT + (i < maxEntries % SHARD_COUNT ? 1 : 0);
+        }
+    }
+
+    std::optional<size_t> lookup(std::string_view key) {
+        if (capacity == 0) return std::nullopt;
+        VECTMO_METRICS_TIME(CacheLookup);
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Entry* entry = find(shard, key);
+        if (!entry) return std::nullopt;
+        return entry->row;
+    }
+
+    // The cached word, copied into storage since eviction may free the entry's own
+    std::optional<std::string_view> lookupWord(std::string_view key, std::pmr::memory_resource* storage) {
+        if (capacity == 0) return std::nullopt;
+        VECTMO_METRICS_TIME(CacheLookup);
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Entry* entry = find(shard, key);
+        if (!entry) return std::nullopt;
+        return VectmoArena::copy(entry->word, storage);
+    }
+
+    void insert(std::string_view key, size_t row) { place(key, row, {}); }
+    void insertWord(std::string_view key, std::string_view word) { place(key, 0, word); }
+
+    // Must be called whenever the vocabulary, embeddings or index change
+    void clear() {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.slotByKey.clear();
+            shard.entries.clear();
+            shard.hand = 0;
+        }
+    }
+
+    Stats stats() {
+        Stats result;
+        result.hits = hits.load(std::memory_order_relaxed);
+        result.misses = misses.load(std::memory_order_relaxed);
+        result.capacity = capacity.load(std::memory_order_relaxed);
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.size += shard.entries.size();
+        }
+        return result;
+    }
+};
+
+// Character pair counts over text fed in arbitrary pieces. Bytes are mapped to
+// indices a block at a time; two neighbouring indices then form a 16-bit key
+// (to << 8 | from) read straight from the mapped block, and consecutive pairs
+// alternate between two tables so a run of one common pair ("e ") never waits
+// on its own previous increment. Unsupported bytes map to an extra index V
+// whose row and column are dropped on merge, so counting has no branches.
+class BigramCounter {
+public:
+    static constexpr int V = CharIndexMap::VOCAB_SIZE;
+    using Counts = std::array<std::array<uint32_t, V>, V>;
+
+private:
+    static constexpr uint32_t UNSUPPORTED = static_cast<uint32_t>(V);
+    static constexpr size_t CELLS = (UNSUPPORTED + 1) << 8;
+    static constexpr size_t BLOCK = 4096;
+
+    static constexpr std::array<uint8_t, 256> INDEX_TABLE = [] {
+        std::array<uint8_t, 256> table{};
+        for (int c = 0; c < 256; ++c) {
+            int idx = CharIndexMap()(static_cast<char>(c));
+            table[c] = static_cast<uint8_t>(idx == CharIndexMap::INVALID_INDEX ? UNSUPPORTED : idx);
+        }
+        return table;
+    }();
+
+    std::vector<uint32_t> tables;  // two tables of CELLS counts
+    uint32_t prev = UNSUPPORTED;
+
+    static uint32_t key(const uint8_t* at) { return static_cast<uint32_t>(at[0]) | (static_cast<uint32_t>(at[1]) << 8); }
+
+    void countBlock(const uint8_t* idx, size_t n) {
+        uint32_t* even = tables.data();
+        uint32_t* odd = even + CELLS;
+        ++even[prev | (static_cast<uint32_t>(idx[0]) << 8)];
+        size_t i = 0;
+        for (; i + 2 < n; i += 2) {
+            ++even[key(idx + i)];
+            ++odd[key(idx + i + 1)];
+        }
+        if (i + 1 < n) ++even[key(idx + i)];
+        prev = idx[n - 1];
+    }
+
+public:
+    // Counts every pair inside text plus the one joining it to the previous piece
+    void add(std::string_view text) {
+        if (tables.empty()) tables.assign(2 * CELLS, 0);
+        alignas(64) uint8_t mapped[BLOCK];
+        for (size_t done = 0; done < text.size(); done += BLOCK) {
+            size_t n = std::min(BLOCK, text.size() - done);
+            VectmoKernels::active.mapBytes(INDEX_TABLE.data(), static_cast<uint8_t>(UNSUPPORTED), text.data() + done,
+                                           n, mapped);
+            countBlock(mapped, n);
+        }
+    }
+
+    // Adds the counts so far to out and starts over, forgetting the last char
+    void mergeInto(Counts& out) {
+        if (!tables.empty()) {
+            for (size_t from = 0; from < static_cast<size_t>(V); ++from) {
+                for (size_t to = 0; to < static_cast<size_t>(V); ++to) {
+                    size_t cell = (to << 8) | from;
+                    out[from][to] += tables[cell] + tables[CELLS + cell];
+                }
+            }
+            std::fill(tables.begin(), tables.end(), 0);
+        }
+        prev = UNSUPPORTED;
+    }
+};
+
+// Vocabulary that lives somewhere else, such as on shard servers (see
+// VectmoShardClient). Ids are the remote side's own and stay valid, with the
+// words they name, for the object's lifetime.
+class RemoteVocabulary {
+public:
+    virtual ~RemoteVocabulary() = default;
+
+    // Best word for each query, nullopt where no answer could be had; the words
+    // are copied into storage and live as long as it does. False when queries
+    // went unanswered because the vocabulary could not be reached
+    virtual bool findNearest(std::span<const std::string_view> words, std::span<std::optional<std::string_view>> best,
+                             std::pmr::memory_resource* storage) const = 0;
+};
+
+// Core model data
+class VectmoModel {
+public:
+    // Where this model's rows sit in a vocabulary split by saveShards(); an
+    // unsharded model is shard 0 of 1 holding every row
+    struct ShardInfo {
+        uint32_t index = 0;
+        uint32_t count = 1;
+        uint64_t firstRow = 0;   // global row of local row 0
+        uint64_t totalRows = 0;  // rows across all shards
+    };
+
+private:
+    static constexpr int V = CharIndexMap::VOCAB_SIZE;
+    // Text files without an "alphabet N" line predate the policies and are Printable
+    static constexpr int TEXT_ALPHABET_SIZE = BasicCharIndexMap<VectmoAlphabet::Printable>::VOCAB_SIZE;
+
+    using BigramCounts = BigramCounter::Counts;
+
+    // Dense bigram counts indexed by [charMap(from)][charMap(to)]
+    BigramCounts bigramTable{};
+    // Followers of each row, pre-sorted by descending count (rebuilt after every change)
+    std::array<std::array<char, V>, V> sortedFollowers{};
+    std::array<uint8_t, V> followerCount{};
+    static_assert(V <= 255, "follower counts are bytes");
+    // Sampled generation: a distribution per row shaped by sampling, plus the
+    // row totals scoreSequence() normalizes by
+    SamplingOptions sampling;
+    AliasTable followerAlias;
+    std::array<uint64_t, V> rowTotals{};
+    // Built on the first beam search over the current store
+    mutable std::atomic<std::shared_ptr<const VocabularyPrefixIndex>> prefixes;
+    mutable std::mutex prefixMutex;
+    NgramModel ngrams;
+    // Only populated while training; cacheEmbeddings() moves the words into the
+    // store in sorted order and releases it, so no word is held twice
+    VocabularyTable vocabulary;
+    bool vocabularyInStore = false;  // released words still live in cachedEmbeddings
+    EmbeddingStore cachedEmbeddings;
+    std::unique_ptr<SimilarityIndex> similarityIndex = std::make_unique<ExactScanIndex>();
+    ShardInfo shard;
+    std::shared_ptr<const RemoteVocabulary> remoteVocabulary;
+    mutable SnapCache snapCache;
+    EmbeddingPrecision embeddingPrecision = EmbeddingPrecision::Float32;
+    EmbeddingStore::RowBuild rowBuild = EmbeddingStore::RowBuild::Eager;
+    CharIndexMap charMap;
+
+    // Same whitespace set operator>> splits on in the classic locale
+    static bool isTokenSeparator(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    // Each thread counts bigrams and collects words over its own whitespace-aligned
+    // chunk; the per-thread tables are merged once all chunks are done
+    void trainParallel(const std::string& text, unsigned threadCount) {
+        std::vector<size_t> bounds{0};
+        for (unsigned t = 1; t < threadCount; ++t) {
+            size_t split = std::max(bounds.back(), text.size() * t / threadCount);
+            while (split < text.size() && !isTokenSeparator(text[split])) ++split;
+            bounds.push_back(split);
+        }
+        bounds.push_back(text.size());
+
+        struct Shard {
+            BigramCounter counts;
+            std::vector<std::string_view> words;
+        };
+        std::vector<Shard> shards(threadCount);
+
+        VectmoThreads::runShards(threadCount, [&](unsigned t) {
+            Shard& shard = shards[t];
+            size_t begin = bounds[t];
+            size_t end = bounds[t + 1];
+            if (begin == end) return;
+
+            // A chunk owns every bigram that starts inside it, including the
+            // one that straddles into the next chunk
+            size_t last = std::min(end + 1, text.size());
+            shard.counts.add(std::string_view(text).substr(begin, last - begin));
+
+            std::unordered_set<std::string_view> seen;
+            size_t tokenStart = begin;
+            for (size_t i = begin; i <= end; ++i) {
+                if (i == end || isTokenSeparator(text[i])) {
+                    if (i > tokenStart) seen.emplace(text.data() + tokenStart, i - tokenStart);
+                    tokenStart = i + 1;
+                }
+            }
+            shard.words.assign(seen.begin(), seen.end());
+        });
+
+        for (auto& row : bigramTable) row.fill(0);
+        std::vector<std::string_view> allWords;
+        for (auto& shard : shards) {
+            shard.counts.mergeInto(bigramTable);
+            allWords.insert(allWords.end(), shard.words.begin(), shard.words.end());
+        }
+        rebuildFollowers();
+
+        clearVocabulary();
+        for (std::string_view word : allWords) vocabulary.intern(word);
+    }
+
+    // Carry-over between consecutive buffers of one stream
+    struct StreamState {
+        BigramCounter bigrams;
+        std::string pendingToken;
+        NgramModel::History history;
+    };
+
+    void addWord(std::string_view word) {
+        if (!word.empty()) vocabulary.intern(word);
+    }
+
+    // Adds one buffer's bigrams and words; the last character and any unfinished
+    // token are carried in state so buffer boundaries do not change the counts
+    void accumulate(std::string_view chunk, StreamState& state) {
+        state.bigrams.add(chunk);
+        size_t tokenStart = 0;
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            char c = chunk[i];
+            if (isTokenSeparator(c)) {
+                std::string_view piece = chunk.substr(tokenStart, i - tokenStart);
+                if (state.pendingToken.empty()) {
+                    addWord(piece);
+                } else {
+                    state.pendingToken.append(piece);
+                    addWord(state.pendingToken);
+                    state.pendingToken.clear();
+                }
+                tokenStart = i + 1;
+            }
+        }
+        state.pendingToken.append(chunk.substr(tokenStart));
+        ngrams.observe(chunk, state.history, charMap);
+    }
+
+    void finishStream(StreamState& state, unsigned threadCount = 1) {
+        addWord(state.pendingToken);
+        state.pendingToken.clear();
+        state.bigrams.mergeInto(bigramTable);
+        rebuildFollowers();
+        ngrams.finalize(charMap, sampling);
+        cacheEmbeddings(threadCount);
+    }
+
+    // A trained model keeps its words only in the embedding store (or the mapped
+    // file); intern them again before adding more
+    void materializeVocabulary() {
+        if (!vocabularyInStore) return;
+        for (size_t i = 0; i < cachedEmbeddings.size(); ++i) vocabulary.intern(cachedEmbeddings.word(i));
+        vocabularyInStore = false;
+    }
+
+    // Starts a vocabulary from scratch, forgetting the words of the current store
+    void clearVocabulary() {
+        vocabulary.clear();
+        vocabularyInStore = false;
+    }
+
+    void resetCounts() {
+        for (auto& row : bigramTable) row.fill(0);
+        ngrams.clear();
+        clearVocabulary();
+    }
+
+public:
+    static constexpr size_t STREAM_BUFFER_SIZE = 1 << 20;
+
+    // Trains from a stream read in fixed-size buffers, never holding the whole corpus.
+    // threadCount applies to the embedding build; the stream itself is read serially.
+    bool trainFromStream(std::istream& in, size_t bufferSize = STREAM_BUFFER_SIZE, unsigned threadCount = 1) {
+        resetCounts();
+        return updateFromStream(in, bufferSize, threadCount);
+    }
+
+    bool trainFromFile(const std::string& path, size_t bufferSize = STREAM_BUFFER_SIZE, unsigned threadCount = 1) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        return trainFromStream(file, bufferSize, threadCount);
+    }
+
+    // Adds counts from more text on top of the current model instead of retraining
+    void update(std::string_view text) {
+        materializeVocabulary();
+        StreamState state;
+        accumulate(text, state);
+        finishStream(state);
+    }
+
+    bool updateFromStream(std::istream& in, size_t bufferSize = STREAM_BUFFER_SIZE, unsigned threadCount = 1) {
+        materializeVocabulary();
+        std::vector<char> buffer(std::max<size_t>(bufferSize, 1));
+        StreamState state;
+        while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0) {
+            accumulate(std::string_view(buffer.data(), static_cast<size_t>(in.gcount())), state);
+        }
+        if (in.bad()) return false;
+
+        finishStream(state, threadCount);
+        return true;
+    }
+
+    // threadCount 1 trains serially; 0 uses every hardware thread
+    void train(const std::string& text, unsigned threadCount = 1) {
+        threadCount = VectmoThreads::resolve(threadCount);
+        if (threadCount > 1) {
+            trainParallel(text, threadCount);
+        } else {
+            buildBigramTable(text);
+            buildVocabulary(text);
+        }
+        buildContextTables(text);
+        cacheEmbeddings(threadCount);
+    }
+
+    // Order 3..6 adds context tables that generation backs off from; 2 is bigram only.
+    // Takes effect at the next training run.
+    void setContextOrder(int order) { ngrams.setOrder(order); }
+    int getContextOrder() const { return ngrams.getOrder(); }
+
+    void buildContextTables(std::string_view text) {
+        ngrams.clear();
+        NgramModel::History history;
+        ngrams.observe(text, history, charMap);
+        ngrams.finalize(charMap, sampling);
+    }
+
+    void buildBigramTable(const std::string& text) {
+        for (auto& row : bigramTable) row.fill(0);
+        BigramCounter counter;
+        counter.add(text);
+        counter.mergeInto(bigramTable);
+        rebuildFollowers();
+    }
+
+    // Sort each row once so generation never has to
+    void rebuildFollowers() {
+        for (int from = 0; from < V; ++from) {
+            const auto& row = bigramTable[from];
+            auto& order = sortedFollowers[from];
+            int n = 0;
+            for (int to = 0; to < V; ++to) {
+                if (row[to] > 0) order[n++] = charMap[to];
+            }
+            // Ties keep ascending character order
+            std::sort(order.begin(), order.begin() + n, [&](char a, char b) {
+                uint32_t countA = row[charMap(a)];
+                uint32_t countB = row[charMap(b)];
+                return countA != countB ? countA > countB : a < b;
+            });
+            followerCount[from] = static_cast<uint8_t>(n);
+        }
+        rebuildSamplingTables();
+    }
+
+    // Alias run of each bigram row, laid out like sortedFollowers
+    void rebuildSamplingTables() {
+        followerAlias.resize(static_cast<size_t>(V) * V);
+        std::array<uint32_t, V> counts;
+        std::vector<double> weights;
+        for (int from = 0; from < V; ++from) {
+            const auto& row = bigramTable[from];
+            size_t n = followerCount[from];
+            uint64_t total = 0;
+            for (size_t k = 0; k < n; ++k) {
+                counts[k] = row[charMap(sortedFollowers[from][k])];
+                total += counts[k];
+            }
+            rowTotals[from] = total;
+            sampling.shape(std::span<const uint32_t>(counts.data(), n), weights);
+            followerAlias.build(static_cast<size_t>(from) * V, weights);
+        }
+    }
+
+    // Tokens are views into text, split on the whitespace operator>> would use
+    void buildVocabulary(std::string_view text) {
+        clearVocabulary();
+        size_t tokenStart = 0;
+        for (size_t i = 0; i <= text.size(); ++i) {
+            if (i == text.size() || isTokenSeparator(text[i])) {
+                if (i > tokenStart) vocabulary.intern(text.substr(tokenStart, i - tokenStart));
+                tokenStart = i + 1;
+            }
+        }
+    }
+
+    // Rows are laid out in sorted word order: the tie-break prefers earlier rows
+    void cacheEmbeddings(unsigned threadCount = 1) {
+        materializeVocabulary();
+        cachedEmbeddings.build(vocabulary.sortedWords(), charMap, VectmoThreads::resolve(threadCount),
+                               embeddingPrecision, rowBuild);
+        finishStore();
+    }
+
+    // cacheEmbeddings() for words already sorted and unique, moved in without
+    // hashing or sorting them again
+    void cacheSortedEmbeddings(std::vector<char> pool, std::vector<uint64_t> offsets, unsigned threadCount = 1) {
+        clearVocabulary();
+        cachedEmbeddings.adopt(std::move(pool), std::move(offsets), charMap, VectmoThreads::resolve(threadCount),
+                               embeddingPrecision, rowBuild);
+        finishStore();
+    }
+
+    void finishStore() {
+        vocabulary.clear();
+        vocabularyInStore = true;
+        shard = ShardInfo{0, 1, 0, cachedEmbeddings.size()};
+        rebuildIndex();
+    }
+
+    // Deferred rows let a model built from words (train, the text load) generate
+    // at once; snaps fill the rows they score, and Background fills the rest on a
+    // thread of its own. Indexes other than the exact scan still build every row
+    // up front. Takes effect from the next build.
+    void setEmbeddingBuild(EmbeddingStore::RowBuild build) { rowBuild = build; }
+    bool embeddingsReady() const { return cachedEmbeddings.isMaterialized(); }
+
+    // Uint8 stores each row in a quarter of the float footprint and scores it with
+    // the integer dot kernel; a trained model is re-embedded in the new precision
+    void setEmbeddingPrecision(EmbeddingPrecision precision, unsigned threadCount = 1) {
+        embeddingPrecision = precision;
+        if (cachedEmbeddings.empty() || cachedEmbeddings.getPrecision() == precision) return;
+        ShardInfo same = shard;  // the same rows, so a shard stays that shard
+        materializeVocabulary();
+        cacheEmbeddings(threadCount);
+        shard = same;
+    }
+    EmbeddingPrecision getEmbeddingPrecision() const { return embeddingPrecision; }
+
+    // Swap the search strategy; the new index is built over the current embeddings
+    void setSimilarityIndex(std::unique_ptr<SimilarityIndex> index) {
+        if (!index) index = std::make_unique<ExactScanIndex>();
+        similarityIndex = std::move(index);
+        rebuildIndex();
+    }
+
+    // Cached snaps are keyed by the raw token; 0 disables the cache
+    void setSnapCacheCapacity(size_t maxEntries) { snapCache.setCapacity(maxEntries); }
+    SnapCache::Stats snapCacheStats() const { return snapCache.stats(); }
+
+    bool hasBigram(char c) const {
+        int idx = charMap(c);
+        return idx != CharIndexMap::INVALID_INDEX && followerCount[idx] > 0;
+    }
+
+    // Followers for whatever comes after history: the longest known context at
+    // the configured order, backing off down to the bigram row of its last char
+    std::span<const char> getContextFollowers(std::string_view history) const {
+        if (history.empty()) return {};
+        if (ngrams.enabled()) {
+            auto followers = ngrams.followersAfter(history, charMap);
+            if (!followers.empty()) return followers;
+        }
+        return getTopFollowers(history.back());
+    }
+
+    // One follower of history drawn from the sampling distribution, with the same
+    // context backoff as getContextFollowers; '\0' if nothing follows
+    char sampleFollower(std::string_view history, VectmoRandom& rng) const {
+        if (history.empty()) return '\0';
+        if (ngrams.enabled()) {
+            char next = ngrams.sampleAfter(history, charMap, rng);
+            if (next != '\0') return next;
+        }
+        int idx = charMap(history.back());
+        if (idx == CharIndexMap::INVALID_INDEX || followerCount[idx] == 0) return '\0';
+        size_t offset = static_cast<size_t>(idx) * V;
+        return sortedFollowers[idx][followerAlias.draw(offset, followerCount[idx], rng)];
+    }
+
+    // The distribution sampleFollower draws from: the same followers as
+    // getContextFollowers(history), with their relative chances in weights (at
+    // least VOCAB_SIZE entries); followers the sampling options truncate weigh 0
+    std::span<const char> followerWeights(std::string_view history, std::span<double> weights) const {
+        if (history.empty()) return {};
+        if (ngrams.enabled()) {
+            auto followers = ngrams.weightsAfter(history, charMap, weights);
+            if (!followers.empty()) return followers;
+        }
+        int idx = charMap(history.back());
+        if (idx == CharIndexMap::INVALID_INDEX || followerCount[idx] == 0) return {};
+        followerAlias.weights(static_cast<size_t>(idx) * V, followerCount[idx], weights);
+        return std::span<const char>(sortedFollowers[idx].data(), followerCount[idx]);
+    }
+
+    // Reshapes the sampling tables; greedy generation is unaffected
+    void setSamplingOptions(const SamplingOptions& options) {
+        sampling = options;
+        rebuildSamplingTables();
+        if (ngrams.enabled()) ngrams.finalize(charMap, sampling);
+    }
+    const SamplingOptions& getSamplingOptions() const { return sampling; }
+
+    // Mean bigram log-probability per character of text, for reranking sampled
+    // candidates; unseen pairs count as UNSEEN_LOG_PROBABILITY
+    static constexpr double UNSEEN_LOG_PROBABILITY = -20.0;
+    double scoreSequence(std::string_view text) const {
+        if (text.size() < 2) return 0.0;
+        double sum = 0.0;
+        for (size_t i = 1; i < text.size(); ++i) sum += bigramLogProbability(text[i - 1], text[i]);
+        return sum / static_cast<double>(text.size() - 1);
+    }
+
+    double bigramLogProbability(char from, char to) const {
+        int fromIdx = charMap(from);
+        int toIdx = charMap(to);
+        if (fromIdx == CharIndexMap::INVALID_INDEX || toIdx == CharIndexMap::INVALID_INDEX) return UNSEEN_LOG_PROBABILITY;
+        uint32_t count = bigramTable[fromIdx][toIdx];
+        if (count == 0) return UNSEEN_LOG_PROBABILITY;
+        return std::log(static_cast<double>(count) / static_cast<double>(rowTotals[fromIdx]));
+    }
+
+    // Prefix view of the vocabulary for decoders that spell whole words; built
+    // once per store and shared by every caller
+    std::shared_ptr<const VocabularyPrefixIndex> prefixIndex() const {
+        if (auto index = prefixes.load()) return index;
+        std::lock_guard<std::mutex> lock(prefixMutex);
+        auto index = prefixes.load();
+        if (!index) {
+            index = std::make_shared<const VocabularyPrefixIndex>(cachedEmbeddings);
+            prefixes.store(index);
+        }
+        return index;
+    }
+
+    // Followers of c by descending count; a view into the cached row, no allocation
+    std::span<const char> getTopFollowers(char c, int maxCount = 0) const {
+        int idx = charMap(c);
+        if (idx == CharIndexMap::INVALID_INDEX) return {};
+
+        size_t n = followerCount[idx];
+        if (maxCount > 0 && n > static_cast<size_t>(maxCount)) n = maxCount;
+        return std::span<const char>(sortedFollowers[idx].data(), n);
+    }
+
+    std::optional<std::string> findMostSimilarWord(const std::string& word) const {
+        auto best = findMostSimilarWordView(word);
+        if (!best) return std::nullopt;
+        return std::string(*best);
+    }
+
+    // Allocation-free form: the view points into the embedding store and stays
+    // valid for the lifetime of this model, or until it is retrained. A remote
+    // vocabulary's words are request scratch instead: they live until the
+    // outermost VectmoArena::Scope ends, or outside any Scope until the next
+    // remote snap on this thread
+    std::optional<std::string_view> findMostSimilarWordView(std::string_view word) const {
+        std::optional<std::string_view> best;
+        findMostSimilarWordViews(std::span<const std::string_view>(&word, 1),
+                                 std::span<std::optional<std::string_view>>(&best, 1));
+        return best;
+    }
+
+    // Snaps many words with a single pass over the embedding store
+    std::vector<std::optional<std::string>> findMostSimilarWords(std::span<const std::string> words) const {
+        std::vector<std::string_view> views(words.begin(), words.end());
+        std::vector<std::optional<std::string>> results(words.size());
+        auto best = findMostSimilarWordViews(views);
+        for (size_t j = 0; j < words.size(); ++j) {
+            if (best[j]) results[j] = std::string(*best[j]);
+        }
+        return results;
+    }
+
+    using Neighbor = SimilarityIndex::Neighbor;
+
+    // The k words most similar to word, best first, as store rows (see wordAt)
+    // with their cosine scores, from one pass of the index; the first is the
+    // word findMostSimilarWord picks. Searches the local store only and skips
+    // the snap cache.
+    std::vector<Neighbor> findTopKSimilar(std::string_view word, size_t k) const {
+        std::vector<Neighbor> out(std::min(k, cachedEmbeddings.size()));
+        out.resize(findTopKSimilar(word, out));
+        return out;
+    }
+
+    // Allocation-free form: fills up to out.size() neighbours, returns how many
+    size_t findTopKSimilar(std::string_view word, std::span<Neighbor> out) const {
+        if (cachedEmbeddings.empty() || out.empty()) return 0;
+        VECTMO_METRICS_TIME(Search);
+        EmbeddingQuery query(CharHistogram(word, charMap), word.size());
+        return similarityIndex->findTopK(query, out);
+    }
+
+    // Top k for many words with one pass over the store: word j's neighbours
+    // are out[j * k, j * k + counts[j]), so out needs words.size() * k entries
+    void findTopKSimilarBatch(std::span<const std::string_view> words, size_t k, std::span<Neighbor> out,
+                              std::span<size_t> counts) const {
+        std::fill(counts.begin(), counts.end(), 0);
+        if (cachedEmbeddings.empty() || words.empty() || k == 0) return;
+        VECTMO_METRICS_TIME(Search);
+        std::pmr::vector<EmbeddingQuery> queries(VectmoArena::scratch());
+        queries.reserve(words.size());
+        for (std::string_view word : words) queries.emplace_back(CharHistogram(word, charMap), word.size());
+        similarityIndex->findTopKBatch(queries, out.first(words.size() * k), counts);
+    }
+
+    std::vector<std::vector<Neighbor>> findTopKSimilarBatch(std::span<const std::string_view> words,
+                                                            size_t k) const {
+        k = std::min(k, cachedEmbeddings.size());
+        std::vector<Neighbor> flat(words.size() * k);
+        std::vector<size_t> counts(words.size());
+        findTopKSimilarBatch(words, k, flat, counts);
+        std::vector<std::vector<Neighbor>> results(words.size());
+        for (size_t j = 0; j < words.size(); ++j) {
+            results[j].assign(flat.begin() + j * k, flat.begin() + j * k + counts[j]);
+        }
+        return results;
+    }
+
+    // Word of a store row, as returned by findTopKSimilar; valid like findMostSimilarWordView
+    std::string_view wordAt(size_t row) const { return cachedEmbeddings.word(row); }
+
+    std::vector<std::optional<std::string_view>> findMostSimilarWordViews(
+        std::span<const std::string_view> words) const {
+        std::vector<std::optional<std::string_view>> results(words.size());
+        findMostSimilarWordViews(words, results);
+        return results;
+    }
+
+    // Writes one result per word into results, valid like findMostSimilarWordView;
+    // its working lists are request scratch. False when a remote vocabulary
+    // could not be reached: the words it left unanswered are nullopt
+    bool findMostSimilarWordViews(std::span<const std::string_view> words,
+                                  std::span<std::optional<std::string_view>> results) const {
+        if (remoteVocabulary) return findNearestRemote(words, results);
+        std::pmr::vector<std::optional<size_t>> rows(words.size(), VectmoArena::scratch());
+        findNearestRows(words, rows);
+        for (size_t j = 0; j < words.size(); ++j) {
+            results[j] = rows[j] ? std::optional<std::string_view>(cachedEmbeddings.word(*rows[j])) : std::nullopt;
+        }
+        return true;
+    }
+
+    // Snaps go to vocabulary instead of the local store, e.g. a VectmoShardClient
+    // on a coordinator; nullptr goes back to the local store. Beam search still
+    // spells from the local store.
+    void setRemoteVocabulary(std::shared_ptr<const RemoteVocabulary> vocabulary) {
+        remoteVocabulary = std::move(vocabulary);
+        snapCache.clear();
+    }
+
+    // A shard server's answer for one token: the shard's best word, its cosine
+    // score and its global row, everything a coordinator needs to merge shards
+    struct SnapMatch {
+        std::string_view word;
+        double score = 0.0;
+        uint64_t row = 0;
+    };
+
+    // Local store only; a model with a remote vocabulary has no matches to give
+    void findSnapMatches(std::span<const std::string_view> words, std::span<std::optional<SnapMatch>> out) const {
+        std::fill(out.begin(), out.end(), std::nullopt);
+        if (remoteVocabulary) return;
+        std::pmr::vector<std::optional<size_t>> rows(words.size(), VectmoArena::scratch());
+        findNearestRows(words, rows);
+        for (size_t j = 0; j < words.size(); ++j) {
+            if (!rows[j]) continue;
+            // Counts are exact in every kernel, so rescoring the winner reproduces the search score
+            EmbeddingQuery query(CharHistogram(words[j], charMap), words[j].size());
+            uint32_t id = static_cast<uint32_t>(*rows[j]);
+            double score = 0.0;
+            cachedEmbeddings.scoreRows(query, &id, 1, &score);
+            out[j] = SnapMatch{cachedEmbeddings.word(*rows[j]), score, shard.firstRow + *rows[j]};
+        }
+    }
+
+    // Every file is written beside its target and renamed over it, so a reader of
+    // the old files (such as a model mapping the old .vbin) keeps its inode
+    bool save(const std::string& basePath) const {
+        std::string ngramPath = basePath + ".ngrams";
+        std::ofstream bigramFile, vocabFile, ngramFile;
+        // On any failure, drops the temporaries this call created and has not renamed yet
+        auto abandon = [&] {
+            std::pair<std::ofstream*, std::string> temporaries[] = {
+                {&bigramFile, basePath + ".txt"}, {&vocabFile, basePath + ".words"}, {&ngramFile, ngramPath}};
+            for (auto& [file, path] : temporaries) {
+                if (!file->is_open()) continue;
+                file->close();
+                std::remove((path + TEMP_SUFFIX).c_str());
+            }
+            return false;
+        };
+
+        // Save bigram table
+        bigramFile.open(basePath + ".txt" + TEMP_SUFFIX);
+        if (!bigramFile) return abandon();
+        
+        if (V != TEXT_ALPHABET_SIZE) bigramFile << "alphabet " << V << '\n';
+        for (int fromIdx = 0; fromIdx < V; ++fromIdx) {
+            for (int toIdx = 0; toIdx < V; ++toIdx) {
+                uint32_t count = bigramTable[fromIdx][toIdx];
+                if (count == 0) continue;
+                bigramFile << fromIdx << ' ' << toIdx << ' ' << count << '\n';
+            }
+        }
+        
+        // Save vocabulary
+        vocabFile.open(basePath + ".words" + TEMP_SUFFIX);
+        if (!vocabFile) return abandon();
+        
+        for (size_t i = 0; i < cachedEmbeddings.size(); ++i) {
+            vocabFile << cachedEmbeddings.word(i) << '\n';
+        }
+
+        // Save context tables: "order N", then "ctx... next count" in char indices
+        if (ngrams.enabled()) {
+            ngramFile.open(ngramPath + TEMP_SUFFIX);
+            if (!ngramFile) return abandon();
+
+            ngramFile << "order " << ngrams.getOrder() << '\n';
+            ngrams.forEachCount([&](uint64_t key, uint64_t count) {
+                auto [context, next] = NgramModel::decodePair(key);
+                for (int idx : context) ngramFile << idx << ' ';
+                ngramFile << next << ' ' << count << '\n';
+            });
+        }
+
+        bool saved = replaceFile(bigramFile, basePath + ".txt") && replaceFile(vocabFile, basePath + ".words") &&
+                     (!ngrams.enabled() || replaceFile(ngramFile, ngramPath));
+        if (!saved) return abandon();
+        if (!ngrams.enabled()) std::remove(ngramPath.c_str());
+        return true;
+    }
+
+    bool load(const std::string& basePath) {
+        // Load bigram table
+        std::ifstream bigramFile(basePath + ".txt");
+        if (!bigramFile) return false;
+        
+        // Indices only mean something under the alphabet that wrote them
+        int fileAlphabet = TEXT_ALPHABET_SIZE;
+        if ((bigramFile >> std::ws).peek() == 'a') {
+            std::string tag;
+            bigramFile >> tag >> fileAlphabet;
+        }
+        if (fileAlphabet != V) return false;
+
+        for (auto& row : bigramTable) row.fill(0);
+        int fromIdx, toIdx;
+        uint32_t count;
+        while (bigramFile >> fromIdx >> toIdx >> count) {
+            if (fromIdx >= 0 && fromIdx < V && toIdx >= 0 && toIdx < V) {
+                bigramTable[fromIdx][toIdx] = count;
+            }
+        }
+        rebuildFollowers();
+        
+        // Load vocabulary: save() writes it sorted, so it normally goes straight
+        // into the store; anything else is interned and sorted like training words
+        std::ifstream vocabFile(basePath + ".words", std::ios::binary);
+        if (!vocabFile) return false;
+        std::vector<char> pool{std::istreambuf_iterator<char>(vocabFile), std::istreambuf_iterator<char>()};
+        // Lines are compacted in place: the newlines go and each word moves down
+        std::vector<uint64_t> offsets{0};
+        bool sorted = true;
+        std::string_view previous;
+        for (size_t start = 0; start < pool.size();) {
+            size_t end = std::find(pool.begin() + start, pool.end(), '\n') - pool.begin();
+            if (end > start) {
+                size_t length = end - start;
+                std::memmove(pool.data() + offsets.back(), pool.data() + start, length);
+                std::string_view word(pool.data() + offsets.back(), length);
+                sorted = sorted && (offsets.size() == 1 || previous < word);
+                previous = word;
+                offsets.push_back(offsets.back() + length);
+            }
+            start = end + 1;
+        }
+        pool.resize(offsets.back());
+        pool.shrink_to_fit();
+        if (!sorted) {
+            clearVocabulary();
+            for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                vocabulary.intern(std::string_view(pool.data() + offsets[i], offsets[i + 1] - offsets[i]));
+            }
+        }
+
+        // Load context tables, if the model was trained with any
+        ngrams.setOrder(NgramModel::MIN_ORDER);
+        std::ifstream ngramFile(basePath + ".ngrams");
+        std::string label;
+        int order = NgramModel::MIN_ORDER;
+        if (ngramFile >> label >> order && label == "order") {
+            ngrams.setOrder(order);
+            std::string line;
+            std::getline(ngramFile, line);
+            while (std::getline(ngramFile, line)) {
+                std::istringstream fields(line);
+                std::vector<long long> values;
+                long long value;
+                while (fields >> value) values.push_back(value);
+                if (values.size() < 4 || values.back() <= 0) continue;
+
+                std::vector<int> context(values.begin(), values.end() - 2);
+                int next = static_cast<int>(values[values.size() - 2]);
+                uint64_t key = NgramModel::encodePair(context, next);
+                if (key != 0) ngrams.addCount(key, static_cast<uint64_t>(values.back()));
+            }
+            ngrams.finalize(charMap, sampling);
+        }
+        
+        // Rebuild cache
+        if (sorted) {
+            cacheSortedEmbeddings(std::move(pool), std::move(offsets));
+        } else {
+            cacheEmbeddings();
+        }
+        
+        return true;
+    }
+
+    // Single-file binary model: header, bigram matrix, word offsets, string pool,
+    // inverse norms and embedding rows, each section 64-byte aligned so the file
+    // can be mapped and used in place
+    bool saveBinary(const std::string& path) const {
+        return saveBinaryRows(path, 0, cachedEmbeddings.size(), ShardInfo{0, 1, 0, cachedEmbeddings.size()});
+    }
+
+    const ShardInfo& getShardInfo() const { return shard; }
+
+    // Splits the vocabulary by word id into shardCount contiguous ranges and writes
+    // each as a binary model, basePath + ".shard<i>.vbin". Every shard carries the
+    // full bigram and context tables, so any one of them can also generate.
+    bool saveShards(const std::string& basePath, uint32_t shardCount) const {
+        if (shardCount == 0 || shard.count != 1) return false;
+        uint64_t n = cachedEmbeddings.size();
+        for (uint32_t i = 0; i < shardCount; ++i) {
+            uint64_t first = n * i / shardCount;
+            uint64_t last = n * (i + 1) / shardCount;
+            if (!saveBinaryRows(shardPath(basePath, i), first, last, ShardInfo{i, shardCount, first, n})) return false;
+        }
+        return true;
+    }
+
+    static std::string shardPath(const std::string& basePath, uint32_t index) {
+        return basePath + ".shard" + std::to_string(index) + ".vbin";
+    }
+
+    // Rows [first, last) of the store as a binary model labelled with info
+    bool saveBinaryRows(const std::string& path, uint64_t first, uint64_t last, const ShardInfo& info) const {
+        // Never truncated in place: a model may be mapping the old file right now
+        std::ofstream file(path + TEMP_SUFFIX, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        uint64_t wordCount = last - first;
+        cachedEmbeddings.materialize(first, wordCount);
+        const uint64_t* globalOffsets = cachedEmbeddings.offsetData();
+        uint64_t poolStart = wordCount > 0 ? globalOffsets[first] : 0;
+        std::vector<uint64_t> offsets(wordCount + 1, 0);
+        for (uint64_t i = 0; i <= wordCount && wordCount > 0; ++i) offsets[i] = globalOffsets[first + i] - poolStart;
+
+        BinaryHeader header;
+        uint64_t offset = alignSection(sizeof(BinaryHeader));
+        header.bigramOffset = offset;
+        offset = alignSection(offset + sizeof(BigramCounts));
+        header.offsetsOffset = offset;
+        offset = alignSection(offset + (wordCount + 1) * sizeof(uint64_t));
+        header.poolOffset = offset;
+        header.poolSize = offsets[wordCount];
+        offset = alignSection(offset + header.poolSize);
+        header.normsOffset = offset;
+        offset = alignSection(offset + wordCount * sizeof(double));
+        header.rowsOffset = offset;
+        offset = alignSection(offset + wordCount * cachedEmbeddings.rowBytes());
+        header.masksOffset = offset;
+        offset = alignSection(offset + wordCount * sizeof(CharPresenceMask));
+        header.wordCount = wordCount;
+        header.rowPrecision = static_cast<uint32_t>(cachedEmbeddings.getPrecision());
+        header.rowWidth = static_cast<uint32_t>(header.expectedRowWidth());
+        header.shardIndex = info.index;
+        header.shardCount = info.count;
+        header.shardFirstRow = info.firstRow;
+        header.shardTotalRows = info.totalRows;
+
+        std::vector<uint64_t> ngramPairs;
+        ngrams.forEachCount([&](uint64_t key, uint64_t count) {
+            ngramPairs.push_back(key);
+            ngramPairs.push_back(count);
+        });
+        header.ngramOrder = static_cast<uint32_t>(ngrams.getOrder());
+        header.ngramOffset = offset;
+        header.ngramCount = ngramPairs.size() / 2;
+        offset += ngramPairs.size() * sizeof(uint64_t);
+        header.fileSize = offset;
+
+        size_t rowBytes = cachedEmbeddings.rowBytes();
+        const char* rows = static_cast<const char*>(cachedEmbeddings.rowData());
+        writeSection(file, 0, &header, sizeof(header));
+        writeSection(file, header.bigramOffset, bigramTable.data(), sizeof(BigramCounts));
+        writeSection(file, header.offsetsOffset, offsets.data(), (wordCount + 1) * sizeof(uint64_t));
+        writeSection(file, header.poolOffset, cachedEmbeddings.poolData() + poolStart, header.poolSize);
+        writeSection(file, header.normsOffset, cachedEmbeddings.normData() + first, wordCount * sizeof(double));
+        writeSection(file, header.rowsOffset, rows + first * rowBytes, wordCount * rowBytes);
+        writeSection(file, header.masksOffset, cachedEmbeddings.maskData() + first, wordCount * sizeof(CharPresenceMask));
+        writeSection(file, header.ngramOffset, ngramPairs.data(), ngramPairs.size() * sizeof(uint64_t));
+        return replaceFile(file, path);
+    }
+
+    // Maps a saveBinary() file; embeddings and words are used in place, and worker
+    // processes mapping the same file share its pages
+    bool loadBinary(const std::string& path) {
+        auto file = MappedFile::open(path);
+        if (!file || file->size() < sizeof(BinaryHeader)) return false;
+
+        BinaryHeader header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (!header.isCompatible() || header.fileSize != file->size()) return false;
+        if (header.version < 2) {
+            header.ngramOrder = NgramModel::MIN_ORDER;
+            header.ngramOffset = 0;
+            header.ngramCount = 0;
+        }
+        if (header.version < 3) header.masksOffset = 0;
+        if (header.version < 4) {
+            header.shardIndex = 0;
+            header.shardCount = 1;
+            header.shardFirstRow = 0;
+            header.shardTotalRows = header.wordCount;
+        }
+        // Written as subtractions so a crafted count cannot wrap past the checks
+        if (header.shardCount == 0 || header.shardIndex >= header.shardCount ||
+            header.wordCount > header.shardTotalRows ||
+            header.shardFirstRow > header.shardTotalRows - header.wordCount) {
+            return false;
+        }
+
+        uint64_t n = header.wordCount;
+        auto precision = static_cast<EmbeddingPrecision>(header.rowPrecision);
+        uint64_t rowBytes =
+            precision == EmbeddingPrecision::Uint8 ? EmbeddingStore::COMPACT_ROW_WIDTH
+                                                   : EmbeddingStore::ROW_WIDTH * sizeof(float);
+        // Every row takes at least rowBytes of the file, which bounds all the
+        // per-row section sizes below; the n-gram pairs are bounded the same way
+        if (n > header.fileSize / rowBytes || header.ngramCount > header.fileSize / (2 * sizeof(uint64_t))) {
+            return false;
+        }
+        auto fits = [&](uint64_t offset, uint64_t bytes) {
+            return offset % SECTION_ALIGNMENT == 0 && offset <= header.fileSize &&
+                   bytes <= header.fileSize - offset;
+        };
+        if (!fits(header.bigramOffset, sizeof(BigramCounts)) ||
+            !fits(header.offsetsOffset, (n + 1) * sizeof(uint64_t)) ||
+            !fits(header.poolOffset, header.poolSize) ||
+            !fits(header.normsOffset, n * sizeof(double)) ||
+            !fits(header.rowsOffset, n * rowBytes) ||
+            (header.masksOffset != 0 && !fits(header.masksOffset, n * sizeof(CharPresenceMask))) ||
+            (header.ngramCount > 0 && !fits(header.ngramOffset, header.ngramCount * 2 * sizeof(uint64_t)))) {
+            return false;
+        }
+
+        const char* base = file->data();
+        const auto* offsets = reinterpret_cast<const uint64_t*>(base + header.offsetsOffset);
+        // Every word must lie inside the pool, or word(i) would read past the mapping
+        if (offsets[0] != 0 || offsets[n] != header.poolSize) return false;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (offsets[i] > offsets[i + 1]) return false;
+        }
+
+        // The bigram matrix is tiny; copying it keeps the generation path unchanged
+        std::memcpy(bigramTable.data(), base + header.bigramOffset, sizeof(BigramCounts));
+        rebuildFollowers();
+
+        // Context tables are rebuilt from their counts; they are small next to the embeddings
+        ngrams.setOrder(static_cast<int>(header.ngramOrder));
+        for (uint64_t i = 0; i < header.ngramCount; ++i) {
+            uint64_t pair[2];
+            std::memcpy(pair, base + header.ngramOffset + i * sizeof(pair), sizeof(pair));
+            if (pair[0] != 0) ngrams.addCount(pair[0], pair[1]);
+        }
+        ngrams.finalize(charMap, sampling);
+
+        vocabulary.clear();
+        vocabularyInStore = true;
+        embeddingPrecision = precision;
+        const auto* masks = header.masksOffset != 0
+                                ? reinterpret_cast<const CharPresenceMask*>(base + header.masksOffset)
+                                : nullptr;
+        cachedEmbeddings.attach(file, n, precision, base + header.rowsOffset,
+                                reinterpret_cast<const double*>(base + header.normsOffset), masks, offsets,
+                                base + header.poolOffset);
+        shard = {header.shardIndex, header.shardCount, header.shardFirstRow, header.shardTotalRows};
+        rebuildIndex();
+        return true;
+    }
+
+    bool isTrained() const {
+        bool anyBigram = std::any_of(followerCount.begin(), followerCount.end(),
+                                     [](uint8_t n) { return n > 0; });
+        return anyBigram && !cachedEmbeddings.empty();
+    }
+
+    // Vocabulary in sorted order, viewed from the embedding store
+    std::vector<std::string_view> getVocabulary() const {
+        std::vector<std::string_view> words;
+        words.reserve(cachedEmbeddings.size());
+        for (size_t i = 0; i < cachedEmbeddings.size(); ++i) words.push_back(cachedEmbeddings.word(i));
+        return words;
+    }
+
+private:
+    static constexpr uint64_t SECTION_ALIGNMENT = 64;
+
+    // Best row for each word: snap cache first, then one batched search of the
+    // index for the misses
+    void findNearestRows(std::span<const std::string_view> words, std::span<std::optional<size_t>> rows) const {
+        std::fill(rows.begin(), rows.end(), std::nullopt);
+        if (cachedEmbeddings.empty() || words.empty()) return;
+        VECTMO_METRICS_COUNT(SnapQueries, words.size());
+
+        std::pmr::memory_resource* scratch = VectmoArena::scratch();
+        std::pmr::vector<size_t> missing(scratch);
+        missing.reserve(words.size());
+        for (size_t j = 0; j < words.size(); ++j) {
+            if (auto cached = snapCache.lookup(words[j])) {
+                rows[j] = *cached;
+                continue;
+            }
+            missing.push_back(j);
+        }
+        if (missing.empty()) return;
+
+        std::pmr::vector<std::optional<size_t>> best(missing.size(), scratch);
+        {
+            VECTMO_METRICS_TIME(Search);
+            if (missing.size() == 1) {
+                EmbeddingQuery query(CharHistogram(words[missing[0]], charMap), words[missing[0]].size());
+                best[0] = similarityIndex->findNearest(query);
+            } else {
+                std::pmr::vector<EmbeddingQuery> queries(scratch);
+                queries.reserve(missing.size());
+                for (size_t j : missing) queries.emplace_back(CharHistogram(words[j], charMap), words[j].size());
+                similarityIndex->findNearestBatch(queries, best);
+            }
+        }
+        for (size_t m = 0; m < missing.size(); ++m) {
+            if (!best[m]) continue;
+            rows[missing[m]] = *best[m];
+            snapCache.insert(words[missing[m]], *best[m]);
+        }
+    }
+
+    // Where remote answers are copied: the request arena, or outside any Scope a
+    // per-thread buffer that each such snap starts afresh
+    static std::pmr::memory_resource* remoteWordStorage() {
+        if (VectmoArena::inScope()) return VectmoArena::scratch();
+        thread_local std::optional<std::pmr::monotonic_buffer_resource> lastSnap;
+        lastSnap.emplace();
+        return &*lastSnap;
+    }
+
+    // findNearestRows for a remote vocabulary; the snap cache keeps the words
+    // themselves, so what the coordinator holds is bounded by its capacity.
+    // False if the remote left words unanswered
+    bool findNearestRemote(std::span<const std::string_view> words,
+                           std::span<std::optional<std::string_view>> results) const {
+        std::fill(results.begin(), results.end(), std::nullopt);
+        if (words.empty()) return true;
+        VECTMO_METRICS_COUNT(SnapQueries, words.size());
+
+        std::pmr::memory_resource* scratch = VectmoArena::scratch();
+        std::pmr::memory_resource* storage = remoteWordStorage();
+        std::pmr::vector<size_t> missing(scratch);
+        std::pmr::vector<std::string_view> asked(scratch);
+        for (size_t j = 0; j < words.size(); ++j) {
+            if (auto cached = snapCache.lookupWord(words[j], storage)) {
+                results[j] = *cached;
+                continue;
+            }
+            missing.push_back(j);
+            asked.push_back(words[j]);
+        }
+        if (missing.empty()) return true;
+
+        std::pmr::vector<std::optional<std::string_view>> best(missing.size(), scratch);
+        bool complete;
+        {
+            VECTMO_METRICS_TIME(Search);
+            complete = remoteVocabulary->findNearest(asked, best, storage);
+        }
+        for (size_t m = 0; m < missing.size(); ++m) {
+            if (!best[m]) continue;  // not cached, so an unreachable remote is asked again next time
+            results[missing[m]] = *best[m];
+            snapCache.insertWord(words[missing[m]], *best[m]);
+        }
+        return complete;
+    }
+
+    // Every change to the embeddings goes through here, so stale snaps never survive
+    void rebuildIndex() {
+        similarityIndex->build(cachedEmbeddings);
+        snapCache.clear();
+        prefixes.store(nullptr);
+    }
+
+    struct BinaryHeader {
+        static constexpr char MAGIC[8] = {'V', 'E', 'C', 'T', 'M', 'O', 'B', '\0'};
+        // Version 2 appended the context-table section, version 3 the presence
+        // masks and version 4 the shard fields; older files still load
+        static constexpr uint32_t VERSION = 4;
+        static constexpr uint32_t MIN_VERSION = 1;
+        static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+        char magic[8] = {'V', 'E', 'C', 'T', 'M', 'O', 'B', '\0'};
+        uint32_t version = VERSION;
+        uint32_t byteOrder = BYTE_ORDER_MARK;
+        uint32_t alphabetSize = V;
+        uint32_t rowWidth = EmbeddingStore::ROW_WIDTH;
+        uint64_t wordCount = 0;
+        uint64_t bigramOffset = 0;
+        uint64_t offsetsOffset = 0;
+        uint64_t poolOffset = 0;
+        uint64_t poolSize = 0;
+        uint64_t normsOffset = 0;
+        uint64_t rowsOffset = 0;
+        uint64_t fileSize = 0;
+        uint32_t ngramOrder = NgramModel::MIN_ORDER;
+        uint32_t rowPrecision = 0;  // EmbeddingPrecision; zero in files written before it existed
+        uint64_t ngramOffset = 0;
+        uint64_t ngramCount = 0;  // (pair key, count) uint64 pairs
+        uint64_t masksOffset = 0;
+        uint32_t shardIndex = 0;
+        uint32_t shardCount = 1;
+        uint64_t shardFirstRow = 0;
+        uint64_t shardTotalRows = 0;
+
+        bool isCompatible() const {
+            return std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                   version >= MIN_VERSION && version <= VERSION &&
+                   byteOrder == BYTE_ORDER_MARK && alphabetSize == static_cast<uint32_t>(V) &&
+                   rowPrecision <= static_cast<uint32_t>(EmbeddingPrecision::Uint8) &&
+                   rowWidth == expectedRowWidth();
+        }
+
+        size_t expectedRowWidth() const {
+            return static_cast<EmbeddingPrecision>(rowPrecision) == EmbeddingPrecision::Uint8
+                       ? EmbeddingStore::COMPACT_ROW_WIDTH
+                       : EmbeddingStore::ROW_WIDTH;
+        }
+    };
+
+    static uint64_t alignSection(uint64_t offset) {
+        return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+
+    static constexpr const char* TEMP_SUFFIX = ".tmp";
+
+    // Closes file, written at path + TEMP_SUFFIX, and renames it over path; on
+    // failure the temporary is removed and path is left as it was
+    static bool replaceFile(std::ofstream& file, const std::string& path) {
+        std::string temp = path + TEMP_SUFFIX;
+        file.close();
+        if (!file || std::rename(temp.c_str(), path.c_str()) != 0) {
+            std::remove(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Pads with zeros up to offset, then writes the section
+    static void writeSection(std::ofstream& file, uint64_t offset, const void* data, uint64_t bytes) {
+        static const char zeros[SECTION_ALIGNMENT] = {};
+        uint64_t position = static_cast<uint64_t>(file.tellp());
+        while (position < offset) {
+            uint64_t pad = std::min<uint64_t>(offset - position, SECTION_ALIGNMENT);
+            file.write(zeros, static_cast<std::streamsize>(pad));
+            position += pad;
+        }
+        if (bytes > 0) file.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+    }
+};
+
+// Remembers every window of the generated text so a candidate can be checked in
+// O(1). A window of up to 8 chars packs exactly into a 64-bit key, so there are
+// no false positives, and the flat table is sized once per generation.
+class CycleDetector {
+public:
+    static constexpr int MAX_WINDOW_SIZE = 8;
+
+private:
+    static constexpr uint64_t EMPTY = 0;  // safe: generated chars are never '\0'
+
+    int windowSize;
+    uint64_t windowMask;
+    uint64_t recent = 0;
+    size_t length = 0;
+    std::pmr::vector<uint64_t> slots;
+    size_t used = 0;
+
+    static size_t mix(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return static_cast<size_t>(key);
+    }
+
+    bool contains(uint64_t key) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = mix(key) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == key) return true;
+            if (slots[i] == EMPTY) return false;
+        }
+    }
+
+    void insert(uint64_t key) {
+        if ((used + 1) * 2 > slots.size()) grow();
+        size_t mask = slots.size() - 1;
+        for (size_t i = mix(key) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == key) return;
+            if (slots[i] == EMPTY) {
+                slots[i] = key;
+                ++used;
+                return;
+            }
+        }
+    }
+
+    void grow() {
+        std::pmr::vector<uint64_t> old(slots.size() * 2, EMPTY, slots.get_allocator());
+        old.swap(slots);
+        used = 0;
+        for (uint64_t key : old) {
+            if (key != EMPTY) insert(key);
+        }
+    }
+
+public:
+    CycleDetector(int window, size_t expectedLength,
+                  std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : windowSize(std::clamp(window, 1, MAX_WINDOW_SIZE)),
+          windowMask(windowSize == 8 ? ~0ULL : (1ULL << (8 * windowSize)) - 1),
+          slots(memory) {
+        size_t capacity = 16;
+        while (capacity < 2 * (expectedLength + 1)) capacity *= 2;
+        slots.assign(capacity, EMPTY);
+    }
+
+    // True if appending candidate would repeat a window already in the text
+    bool wouldCreateCycle(char candidate) const {
+        if (length < static_cast<size_t>(windowSize)) return false;
+        uint64_t key = ((recent << 8) | static_cast<unsigned char>(candidate)) & windowMask;
+        return contains(key);
+    }
+
+    void push(char c) {
+        recent = ((recent << 8) | static_cast<unsigned char>(c)) & windowMask;
+        if (++length >= static_cast<size_t>(windowSize)) insert(recent);
+    }
+};
+
+// Prediction engine. Working memory (cycle tables, beams, token buffers) comes
+// from the scratch resource, by default the calling thread's request arena when
+// a VectmoArena::Scope is open; only returned strings use the regular heap.
+class VectmoPredictor {
+private:
+    const VectmoModel& model;
+    int cycleWindowSize;
+    std::pmr::memory_resource* scratch;
+    mutable bool snapIncomplete = false;
+
+    struct KeepGoing {
+        bool operator()(char) const { return true; }
+    };
+
+public:
+    static constexpr int CYCLE_WINDOW_SIZE = 6;
+
+    // Set once a snap could not reach the model's remote vocabulary, leaving
+    // tokens as generated; requests sharing a predictor reset it in between
+    bool snapsIncomplete() const { return snapIncomplete; }
+    void resetSnapStatus() { snapIncomplete = false; }
+
+    // cycleWindow is clamped to [1, CycleDetector::MAX_WINDOW_SIZE]
+    explicit VectmoPredictor(const VectmoModel& m, int cycleWindow = CYCLE_WINDOW_SIZE,
+                             std::pmr::memory_resource* scratchMemory = VectmoArena::scratch())
+        : model(m), cycleWindowSize(cycleWindow), scratch(scratchMemory) {}
+
+    std::string generateRawSequence(char seed, int maxChars) const {
+        return generateRawSequence(seed, maxChars, KeepGoing{});
+    }
+
+    // onChar(c) sees each generated char as it is appended; returning false stops
+    template <typename OnChar>
+    std::string generateRawSequence(char seed, int maxChars, OnChar&& onChar) const {
+        std::string result;
+        generateRawSequenceInto(result, seed, maxChars, onChar);
+        return result;
+    }
+
+    // Writes the sequence into result (a std::string or std::pmr::string), reusing its storage
+    template <typename String, typename OnChar = KeepGoing>
+    void generateRawSequenceInto(String& result, char seed, int maxChars, OnChar&& onChar = {}) const {
+        VECTMO_METRICS_TIME(Generate);
+        result.assign(1, seed);
+        result.reserve(static_cast<size_t>(std::max(maxChars, 0)) + 1);
+        CycleDetector cycles(cycleWindowSize, result.capacity(), scratch);
+        cycles.push(seed);
+        char current = seed;
+
+        for (int i = 0; i < maxChars; ++i) {
+            if (!model.hasBigram(current)) break;
+
+            auto followers = model.getContextFollowers(result);
+            char chosen = '\0';
+
+            for (char candidate : followers) {
+                if (!cycles.wouldCreateCycle(candidate)) {
+                    chosen = candidate;
+                    break;
+                }
+                VECTMO_METRICS_COUNT(CycleRejections, 1);
+            }
+
+            if (chosen == '\0' && !followers.empty()) {
+                chosen = followers[0];  // forced move
+                VECTMO_METRICS_COUNT(ForcedMoves, 1);
+            }
+
+            if (chosen == '\0') break;
+
+            result += chosen;
+            cycles.push(chosen);
+            current = chosen;
+            if (!onChar(chosen)) break;
+        }
+    }
+
+    // Like generateRawSequence, but each char is drawn from the model's sampling
+    // tables. A draw that would close a cycle is dropped from the distribution
+    // and the rest redrawn, up to MAX_REDRAWS times before it is accepted anyway.
+    // Once truncation leaves nothing to redraw (always, with one follower kept)
+    // the char is picked by generateRawSequence's ranked walk, so top-k 1 and
+    // temperature 0 decode greedily.
+    static constexpr int MAX_REDRAWS = 4;
+    std::string generateSampledSequence(char seed, int maxChars, VectmoRandom& rng) const {
+        return generateSampledSequence(seed, maxChars, rng, KeepGoing{});
+    }
+
+    template <typename OnChar>
+    std::string generateSampledSequence(char seed, int maxChars, VectmoRandom& rng, OnChar&& onChar) const {
+        std::string result;
+        generateSampledSequenceInto(result, seed, maxChars, rng, onChar);
+        return result;
+    }
+
+    template <typename String, typename OnChar = KeepGoing>
+    void generateSampledSequenceInto(String& result, char seed, int maxChars, VectmoRandom& rng,
+                                     OnChar&& onChar = {}) const {
+        VECTMO_METRICS_TIME(Generate);
+        result.assign(1, seed);
+        result.reserve(static_cast<size_t>(std::max(maxChars, 0)) + 1);
+        CycleDetector cycles(cycleWindowSize, result.capacity(), scratch);
+        cycles.push(seed);
+
+        for (int i = 0; i < maxChars; ++i) {
+            char chosen = model.sampleFollower(result, rng);
+            if (chosen == '\0') break;
+            if (cycles.wouldCreateCycle(chosen)) chosen = redrawFollower(result, chosen, cycles, rng);
+
+            result += chosen;
+            cycles.push(chosen);
+            if (!onChar(chosen)) break;
+        }
+    }
+
+    // Streaming snap: generates like generateRawSequence (or the sampled form when
+    // rng is given) and snaps each token the moment the space after it appears,
+    // so the first word is out before the rest are generated. emit(word) is
+    // called once per token in order, empty for a doubled space; joining the
+    // words with single spaces gives snapToVocabulary of the continuation.
+    // Returning false from emit stops generation. False if nothing was generated.
+    template <typename Emit>
+    bool streamSnapped(char seed, int maxChars, Emit&& emit, VectmoRandom* rng = nullptr) const {
+        std::pmr::string token(scratch);
+        bool stopped = false;
+        auto flush = [&](bool rawOnly) {
+            std::string_view word = token;
+            if (!token.empty() && !rawOnly) {
+                VECTMO_METRICS_TIME(Snap);
+                if (auto snapped = snapToken(token)) word = *snapped;
+            }
+            bool keepGoing = emit(word);
+            token.clear();
+            return keepGoing;
+        };
+        auto onChar = [&](char c) {
+            if (c != ' ') {
+                token += c;
+                return true;
+            }
+            stopped = !flush(false);
+            return !stopped;
+        };
+
+        std::pmr::string raw(scratch);
+        if (rng) {
+            generateSampledSequenceInto(raw, seed, maxChars, *rng, onChar);
+        } else {
+            generateRawSequenceInto(raw, seed, maxChars, onChar);
+        }
+        if (raw.size() <= 1) return false;
+        // snapToVocabulary leaves a one-char continuation as it is
+        if (!stopped) flush(raw.size() == 2);
+        return true;
+    }
+
+    // Beam search that spells vocabulary words directly, so only its first token
+    // needs a snap. That token continues the prompt's last word, which may be cut
+    // anywhere, so it runs unconstrained up to the first space (or the longest
+    // word's length) and is snapped at the end, as greedy decoding would. After
+    // it each beam tracks its partial word as a prefix-index node: a branch no word
+    // continues is dropped at once, and a space is only taken after a whole word
+    // not among the last REPEAT_WINDOW spelled. Beams rank by summed bigram log-probability
+    // and identical states merge as they are generated; a candidate that cannot
+    // reach the step's top width is cut before its prefix lookup. Storage is sized once: width beams,
+    // width x V candidates and a width x maxChars history of back pointers.
+    static constexpr int MAX_BEAM_WIDTH = 64;
+    static constexpr size_t REPEAT_WINDOW = 4;
+    std::string beamSearch(char seed, int maxChars, int beamWidth) const {
+        std::string result;
+        beamSearch(seed, maxChars, beamWidth, result);
+        return result;
+    }
+
+    // Writes the words into out, reusing its capacity. Should every beam die, the
+    // continuation is decoded greedily instead, so a prompt greedy decoding can
+    // continue never comes back empty
+    void beamSearch(char seed, int maxChars, int beamWidth, std::string& result) const {
+        searchBeams(seed, maxChars, beamWidth, result);
+        if (!result.empty() || maxChars <= 0) return;
+        std::pmr::string rawSequence(scratch);
+        generateRawSequenceInto(rawSequence, seed, maxChars);
+        if (rawSequence.size() > 1) snapToVocabulary(std::string_view(rawSequence).substr(1), result);
+    }
+
+    std::string snapToVocabulary(const std::string& rawSequence) const {
+        if (rawSequence.size() <= 1) return rawSequence;
+        std::string result;
+        snapToVocabulary(rawSequence, result);
+        return result;
+    }
+
+    // Writes the snapped text into out, reusing its capacity. Tokens are views of
+    // rawSequence and snapped words are views of the store, so a warm buffer
+    // means no allocation beyond cache inserts for unseen tokens.
+    void snapToVocabulary(std::string_view rawSequence, std::string& out) const {
+        VECTMO_METRICS_TIME(Snap);
+        out.clear();
+        if (rawSequence.size() <= 1) {
+            out.append(rawSequence);
+            return;
+        }
+        out.reserve(rawSequence.size());
+        forEachToken(rawSequence, [&](std::string_view token, bool first) {
+            if (!first) out += ' ';
+            if (token.empty()) return;
+            auto snapped = snapToken(token);
+            out.append(snapped ? *snapped : token);  // fallback: keep the raw token
+        });
+    }
+
+    // Same result as snapToVocabulary on each sequence, but every distinct token
+    // across the batch is snapped together in one pass over the embeddings.
+    // incomplete, if given, flags the sequences left with unsnapped tokens
+    std::vector<std::string> snapToVocabularyBatch(std::span<const std::string> rawSequences,
+                                                   std::vector<bool>* incomplete = nullptr) const {
+        return snapBatch(rawSequences, incomplete);
+    }
+    std::vector<std::string> snapToVocabularyBatch(std::span<const std::pmr::string> rawSequences,
+                                                   std::vector<bool>* incomplete = nullptr) const {
+        return snapBatch(rawSequences, incomplete);
+    }
+
+private:
+    std::optional<std::string_view> snapToken(std::string_view token) const {
+        std::optional<std::string_view> best;
+        if (!model.findMostSimilarWordViews(std::span<const std::string_view>(&token, 1),
+                                            std::span<std::optional<std::string_view>>(&best, 1))) {
+            snapIncomplete = true;
+        }
+        return best;
+    }
+
+    char redrawFollower(std::string_view history, char rejected, const CycleDetector& cycles,
+                        VectmoRandom& rng) const {
+        std::array<double, CharIndexMap::VOCAB_SIZE> weights;
+        auto followers = model.followerWeights(history, weights);
+        for (int redraw = 0; redraw < MAX_REDRAWS; ++redraw) {
+            VECTMO_METRICS_COUNT(CycleRejections, 1);
+            double total = 0.0;
+            for (size_t k = 0; k < followers.size(); ++k) {
+                if (followers[k] == rejected) weights[k] = 0.0;
+                total += weights[k];
+            }
+            if (total <= 0.0) {
+                for (char candidate : followers) {
+                    if (!cycles.wouldCreateCycle(candidate)) return candidate;
+                    VECTMO_METRICS_COUNT(CycleRejections, 1);
+                }
+                VECTMO_METRICS_COUNT(ForcedMoves, 1);
+                return followers.empty() ? rejected : followers[0];
+            }
+
+            // Rounding can run past the end; the last follower left then takes it
+            double target = rng.uniform() * total;
+            size_t pick = 0;
+            for (size_t k = 0; k < followers.size(); ++k) {
+                if (weights[k] <= 0.0) continue;
+                pick = k;
+                if (target < weights[k]) break;
+                target -= weights[k];
+            }
+            if (!cycles.wouldCreateCycle(followers[pick])) return followers[pick];
+            rejected = followers[pick];
+        }
+        VECTMO_METRICS_COUNT(ForcedMoves, 1);
+        return rejected;
+    }
+
+    template <typename String>
+    std::vector<std::string> snapBatch(std::span<const String> rawSequences, std::vector<bool>* incomplete) const {
+        VECTMO_METRICS_TIME(Snap);
+        std::pmr::vector<std::string_view> unique(scratch);
+        {
+            VECTMO_METRICS_TIME(Tokenize);
+            for (const auto& raw : rawSequences) {
+                if (raw.size() <= 1) continue;
+                forEachToken(raw, [&](std::string_view token, bool) {
+                    if (!token.empty()) unique.push_back(token);
+                });
+            }
+            std::sort(unique.begin(), unique.end());
+            unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+        }
+
+        std::pmr::vector<std::optional<std::string_view>> snappedUnique(unique.size(), scratch);
+        bool complete = model.findMostSimilarWordViews(unique, snappedUnique);
+        if (!complete) snapIncomplete = true;
+        if (incomplete) incomplete->assign(rawSequences.size(), false);
+
+        std::vector<std::string> results(rawSequences.size());
+        for (size_t i = 0; i < rawSequences.size(); ++i) {
+            std::string_view raw = rawSequences[i];
+            std::string& out = results[i];
+            if (raw.size() <= 1) {
+                out = raw;
+                continue;
+            }
+            out.reserve(raw.size());
+            forEachToken(raw, [&](std::string_view token, bool first) {
+                if (!first) out += ' ';
+                if (token.empty()) return;
+                auto it = std::lower_bound(unique.begin(), unique.end(), token);
+                const auto& snapped = snappedUnique[it - unique.begin()];
+                if (!snapped && !complete && incomplete) (*incomplete)[i] = true;
+                out.append(snapped ? *snapped : token);
+            });
+        }
+        return results;
+    }
+
+    // beamSearch without the greedy fallback; result is empty if every beam died
+    void searchBeams(char seed, int maxChars, int beamWidth, std::string& result) const {
+        VECTMO_METRICS_TIME(Generate);
+        result.clear();
+        if (maxChars <= 0 || !model.hasBigram(seed)) return;
+        auto prefixes = model.prefixIndex();
+        size_t width = static_cast<size_t>(std::clamp(beamWidth, 1, MAX_BEAM_WIDTH));
+        constexpr uint32_t NONE = UINT32_MAX;
+
+        struct Beam {
+            double score = 0.0;
+            VocabularyPrefixIndex::Node node;
+            std::array<uint32_t, REPEAT_WINDOW> recentWords;  // newest first
+            uint32_t step = NONE;  // history entry of the newest char
+            char last = '\0';
+            bool firstToken = true;  // still before the first space; node stays at the root
+
+            bool sameState(const Beam& other) const {
+                return last == other.last && firstToken == other.firstToken && recentWords == other.recentWords &&
+                       node.lo == other.node.lo && node.hi == other.node.hi && node.depth == other.node.depth;
+            }
+        };
+        struct Step {
+            uint32_t parent;
+            char c;
+        };
+
+        std::pmr::vector<Beam> beams(scratch);
+        std::pmr::vector<Beam> candidates(scratch);
+        std::pmr::vector<Step> history(scratch);
+        beams.reserve(width);
+        candidates.reserve(width * CharIndexMap::VOCAB_SIZE);
+        history.reserve(width * static_cast<size_t>(maxChars));
+        Beam start;
+        start.node = prefixes->root();
+        start.recentWords.fill(NONE);
+        start.last = seed;
+        beams.push_back(start);
+
+        // Min-heap of the best width scores among the distinct candidates kept this
+        // step. Followers come by descending count, so once one falls below it the
+        // rest of the row does too. A merge that raises a kept score leaves the old
+        // one here, which only makes the cut more cautious.
+        std::pmr::vector<double> cutoff(scratch);
+        cutoff.reserve(width + 1);
+        auto later = std::greater<double>();
+        auto better = [](const Beam& a, const Beam& b) {
+            return a.score != b.score ? a.score > b.score : a.step < b.step;
+        };
+        // Beams are distinct, so a candidate can only repeat another's state by
+        // finishing a word: both parents then differed in their oldest recent word
+        // alone. Inside the first token the state is just the last char
+        std::pmr::vector<uint32_t> wordEnds(scratch);
+        wordEnds.reserve(width);
+        std::array<uint32_t, 256> firstTokenEnds;
+        size_t longestFirstToken = prefixes->longestWord();
+
+        for (int i = 0; i < maxChars; ++i) {
+            candidates.clear();
+            cutoff.clear();
+            wordEnds.clear();
+            firstTokenEnds.fill(NONE);
+            for (const Beam& beam : beams) {
+                for (char c : model.getTopFollowers(beam.last)) {
+                    double score = beam.score + model.bigramLogProbability(beam.last, c);
+                    if (cutoff.size() == width && score <= cutoff.front()) break;
+                    Beam next = beam;  // step still names the parent until kept
+                    next.last = c;
+                    next.score = score;
+                    if (beam.firstToken) {
+                        if (c == ' ') next.firstToken = false;
+                        else if (static_cast<size_t>(i) >= longestFirstToken) continue;
+                    } else if (c != ' ') {
+                        next.node = prefixes->child(beam.node, c);
+                        if (next.node.empty()) continue;
+                    } else if (beam.node.depth > 0) {
+                        auto row = prefixes->word(beam.node);
+                        const auto& recent = beam.recentWords;
+                        if (!row || std::find(recent.begin(), recent.end(), *row) != recent.end()) continue;
+                        std::copy_backward(recent.begin(), recent.end() - 1, next.recentWords.end());
+                        next.recentWords[0] = *row;
+                        next.node = prefixes->root();
+                    } else {
+                        continue;  // no empty words
+                    }
+                    if (next.firstToken) {
+                        uint32_t& same = firstTokenEnds[static_cast<unsigned char>(c)];
+                        if (same != NONE) {
+                            if (better(next, candidates[same])) candidates[same] = next;
+                            continue;
+                        }
+                        same = static_cast<uint32_t>(candidates.size());
+                    } else if (c == ' ') {
+                        auto same = std::find_if(wordEnds.begin(), wordEnds.end(),
+                                                 [&](uint32_t k) { return candidates[k].sameState(next); });
+                        if (same != wordEnds.end()) {
+                            if (better(next, candidates[*same])) candidates[*same] = next;
+                            continue;
+                        }
+                        wordEnds.push_back(static_cast<uint32_t>(candidates.size()));
+                    }
+                    candidates.push_back(next);
+                    cutoff.push_back(score);
+                    std::push_heap(cutoff.begin(), cutoff.end(), later);
+                    if (cutoff.size() > width) {
+                        std::pop_heap(cutoff.begin(), cutoff.end(), later);
+                        cutoff.pop_back();
+                    }
+                }
+            }
+            if (candidates.empty()) break;
+
+            // Candidates are already distinct, so the next beams are just the head
+            size_t head = std::min(candidates.size(), width);
+            std::partial_sort(candidates.begin(), candidates.begin() + head, candidates.end(), better);
+            beams.clear();
+            for (size_t k = 0; k < head; ++k) {
+                const Beam& candidate = candidates[k];
+                history.push_back({candidate.step, candidate.last});
+                beams.push_back(candidate);
+                beams.back().step = static_cast<uint32_t>(history.size() - 1);
+            }
+        }
+
+        // Prefer the best beam that ends on a word boundary; otherwise finish the
+        // best one's last word with its first completion. A first token that never
+        // ended is snapped like any other
+        const Beam* best = &beams.front();
+        for (const Beam& beam : beams) {
+            if (beam.firstToken || beam.node.depth == 0 || prefixes->word(beam.node)) {
+                best = &beam;
+                break;
+            }
+        }
+        if (best->step == NONE) return;
+
+        for (uint32_t at = best->step; at != NONE; at = history[at].parent) result += history[at].c;
+        std::reverse(result.begin(), result.end());
+        if (best->node.depth > 0 && !prefixes->word(best->node)) {
+            result.append(prefixes->spelling(best->node.lo).substr(best->node.depth));
+        }
+        size_t firstEnd = std::min(result.find(' '), result.size());
+        if (firstEnd > 0) {
+            VECTMO_METRICS_TIME(Snap);
+            if (auto snapped = snapToken(std::string_view(result).substr(0, firstEnd))) {
+                result.replace(0, firstEnd, *snapped);
+            }
+        }
+        while (!result.empty() && result.back() == ' ') result.pop_back();
+    }
+
+    // Calls visit(token, isFirst) for each space-separated token, empty ones included
+    template <typename Visit>
+    static void forEachToken(std::string_view text, Visit&& visit) {
+        size_t start = 0;
+        for (size_t i = 0; i <= text.size(); ++i) {
+            if (i == text.size() || text[i] == ' ') {
+                visit(text.substr(start, i - start), start == 0);
+                start = i + 1;
+            }
+        }
+    }
+};
+
+// Main API class (clean interface).
+// Predictions are safe to run from many threads at once: each call takes the
+// currently published model snapshot and never locks. Retraining or reloading
+// builds a new model on the side and publishes it with an atomic pointer swap,
+// so in-flight requests finish on the snapshot they started with.
+// Configure the working file, threads and index before sharing the object.
+class Vectmo {
+public:
+    using IndexFactory = std::function<std::unique_ptr<SimilarityIndex>()>;
+
+    // Leads an answer whose tokens were partly left unsnapped because the remote
+    // vocabulary could not be reached (VectmoBatchScheduler, VectmoServer)
+    static constexpr std::string_view VOCABULARY_UNREACHABLE = "[Vocabulary unreachable]";
+
+    // A sampled continuation and its mean bigram log-probability per character
+    struct Candidate {
+        std::string text;
+        double score = 0.0;
+    };
+
+private:
+    std::atomic<std::shared_ptr<const VectmoModel>> current;
+    std::mutex writerMutex;  // serializes loads and retrains, never taken by readers
+    IndexFactory indexFactory;
+    std::shared_ptr<const RemoteVocabulary> remoteVocabulary;
+    std::string workingFileBase;
+    unsigned trainingThreads = 1;
+    int contextOrder = NgramModel::MIN_ORDER;
+    EmbeddingPrecision embeddingPrecision = EmbeddingPrecision::Float32;
+    EmbeddingStore::RowBuild embeddingBuild = EmbeddingStore::RowBuild::Eager;
+    std::optional<SamplingOptions> sampling;  // greedy decoding when unset
+    uint64_t samplingSeed = 0;
+    int samplingCandidates = 1;
+    int beamWidth = 0;  // 0 = generate then snap
+    std::ostream* log = &std::cout;
+
+public:
+    // Where status messages go; batch front ends point this at std::cerr to keep stdout clean
+    void setLogStream(std::ostream& stream) { log = &stream; }
+
+    // Threads used by pretrainModel(); 0 uses every hardware thread
+    void setTrainingThreads(unsigned threadCount) { trainingThreads = threadCount; }
+
+    // Context order for models trained from now on (2 = bigram only, up to 6)
+    void setContextOrder(int order) { contextOrder = order; }
+
+    // Row precision for models built or loaded from now on; a loaded file stored
+    // in the other precision is re-embedded
+    void setEmbeddingPrecision(EmbeddingPrecision precision) { embeddingPrecision = precision; }
+
+    // See VectmoModel::setEmbeddingBuild; models loaded from .vbin are mapped and ready anyway
+    void setEmbeddingBuild(EmbeddingStore::RowBuild build) { embeddingBuild = build; }
+
+    // Sampled decoding: every prediction draws `candidates` continuations and
+    // keeps the one scoring best. The same seed and prompt always give the same
+    // text. The table shape applies to models built or loaded from now on;
+    // nullopt goes back to greedy decoding.
+    void setSampling(std::optional<SamplingOptions> options, uint64_t seed = 0, int candidates = 1) {
+        sampling = options;
+        samplingSeed = seed;
+        samplingCandidates = std::max(candidates, 1);
+    }
+
+    // Beam-search decoding that spells vocabulary words directly (see
+    // VectmoPredictor::beamSearch); takes precedence over sampling, 0 turns it off
+    void setBeamWidth(int width) { beamWidth = std::clamp(width, 0, VectmoPredictor::MAX_BEAM_WIDTH); }
+
+    // Applied to every model this object builds; an already published model is
+    // reloaded from the working files so the new index takes effect
+    void setSimilarityIndexFactory(IndexFactory factory) {
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            indexFactory = std::move(factory);
+        }
+        if (current.load()) reloadModel();
+    }
+
+    // Snaps every model this object builds against vocabulary (see
+    // VectmoModel::setRemoteVocabulary); reloads a published model like
+    // setSimilarityIndexFactory
+    void setRemoteVocabulary(std::shared_ptr<const RemoteVocabulary> vocabulary) {
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            remoteVocabulary = std::move(vocabulary);
+        }
+        if (current.load()) reloadModel();
+    }
+
+    bool setWorkingFile(const std::string& fileName) {
+        if (fileName.empty()) {
+            std::cerr << "[ERROR] " << VectmoErrors::ERROR_FILENAME_REQUIRED << '\n';
+            return false;
+        }
+        workingFileBase = fileName;
+        return true;
+    }
+
+    bool createFile() {
+        if (workingFileBase.empty()) {
+            std::cerr << "[ERROR] " << VectmoErrors::ERROR_FILENAME_REQUIRED << '\n';
+            return false;
+        }
+
+        std::ofstream file(workingFileBase + ".txt", std::ios::trunc);
+        if (!file) {
+            std::cerr << "[ERROR] " << VectmoErrors::FILE_NOT_CREATED_ERROR << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    bool pretrainModel(const std::string& trainingText) {
+        if (workingFileBase.empty()) {
+            std::cerr << "[PRETRAIN] ERROR: No file set. Call setWorkingFile() first.\n";
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(writerMutex);
+        auto next = makeModel();
+        next->train(trainingText, trainingThreads);
+        return finishPretrain(next);
+    }
+
+    // Streams the corpus from disk instead of taking it as one string
+    bool pretrainModelFromFile(const std::string& corpusPath) {
+        if (workingFileBase.empty()) {
+            std::cerr << "[PRETRAIN] ERROR: No file set. Call setWorkingFile() first.\n";
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(writerMutex);
+        auto next = makeModel();
+        if (!next->trainFromFile(corpusPath, VectmoModel::STREAM_BUFFER_SIZE, trainingThreads)) {
+            std::cerr << "[PRETRAIN] ERROR: Failed to read " << corpusPath << '\n';
+            return false;
+        }
+        return finishPretrain(next);
+    }
+
+    // Loads the working model now instead of on the first prediction
+    bool loadModel() { return acquireModel() != nullptr; }
+
+    // Re-reads the working files and hot-swaps the result in; the old model
+    // stays live if loading fails
+    bool reloadModel() {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        auto next = loadFromWorkingFiles();
+        if (!next) return false;
+        current.store(std::move(next));
+        return true;
+    }
+
+    // The published model, for callers that drive VectmoPredictor directly
+    std::shared_ptr<const VectmoModel> snapshot() const { return current.load(); }
+
+    std::string predictNextText(const std::string& inputText, int maxChars = 50) {
+        std::string prediction;
+        predictNextText(inputText, prediction, maxChars);
+        return prediction;
+    }
+
+    // Writes the prediction into out, reusing its capacity. Working memory comes
+    // from this thread's VectmoArena, so with a warm snap cache and a large
+    // enough out a greedy or sampled prediction makes no heap allocation.
+    // False when the remote vocabulary could not be reached and some tokens
+    // were left as generated.
+    bool predictNextText(const std::string& inputText, std::string& out, int maxChars = 50) {
+        if (inputText.empty()) {
+            out = "[No input provided]";
+            return true;
+        }
+        VECTMO_METRICS_COUNT(Predictions, 1);
+
+        auto model = acquireModel();
+        if (!model) {
+            out = "[Model not trained yet or file not found]";
+            return true;
+        }
+
+        VectmoArena::Scope scratch;
+        VectmoPredictor predictor(*model, VectmoPredictor::CYCLE_WINDOW_SIZE, scratch.resource());
+        if (beamWidth > 0) {
+            predictor.beamSearch(inputText.back(), maxChars, beamWidth, out);
+            if (out.empty()) out = "[No continuation found]";
+            return !predictor.snapsIncomplete();
+        }
+
+        std::pmr::string rawSequence(scratch.resource());
+        if (sampling) {
+            bestSampledSequence(*model, predictor, inputText, samplingCandidates, maxChars, rawSequence);
+        } else {
+            predictor.generateRawSequenceInto(rawSequence, inputText.back(), maxChars);
+        }
+        if (rawSequence.size() <= 1) {
+            out = "[No continuation found]";
+            return true;
+        }
+        predictor.snapToVocabulary(std::string_view(rawSequence).substr(1), out);  // skip the seed
+        return !predictor.snapsIncomplete();
+    }
+
+    // Returns true to keep streaming, false to stop
+    using WordSink = std::function<bool(std::string_view word)>;
+
+    // predictNextText delivered a word at a time, for low time-to-first-word:
+    // joining the words with single spaces gives what predictNextText returns,
+    // status messages included. Greedy and single-candidate
+    // sampled decoding snap each token as soon as it is generated; beam search
+    // and reranked sampling only settle at the end and deliver their words then.
+    // False if the sink stopped early. incomplete, if given, is set as
+    // predictNextText's result would be.
+    bool predictNextTextStream(const std::string& inputText, const WordSink& sink, int maxChars = 50,
+                               bool* incomplete = nullptr) {
+        if (incomplete) *incomplete = false;
+        if (inputText.empty()) return sink("[No input provided]");
+        if (beamWidth > 0 || (sampling && samplingCandidates > 1)) {
+            std::string prediction;
+            bool complete = predictNextText(inputText, prediction, maxChars);
+            if (incomplete) *incomplete = !complete;
+            size_t start = 0;
+            for (size_t i = 0; i <= prediction.size(); ++i) {
+                if (i < prediction.size() && prediction[i] != ' ') continue;
+                if (!sink(std::string_view(prediction).substr(start, i - start))) return false;
+                start = i + 1;
+            }
+            return true;
+        }
+        VECTMO_METRICS_COUNT(Predictions, 1);
+
+        auto model = acquireModel();
+        if (!model) return sink("[Model not trained yet or file not found]");
+
+        VectmoArena::Scope scratch;
+        std::optional<VectmoRandom> rng;
+        if (sampling) rng.emplace(requestSeed(inputText, 0));
+        bool stopped = false;
+        VectmoPredictor predictor(*model, VectmoPredictor::CYCLE_WINDOW_SIZE, scratch.resource());
+        bool generated = predictor.streamSnapped(inputText.back(), maxChars, [&](std::string_view word) {
+            stopped = !sink(word);
+            return !stopped;
+        }, rng ? &*rng : nullptr);
+        if (incomplete) *incomplete = predictor.snapsIncomplete();
+        if (!generated) return sink("[No continuation found]");
+        return !stopped;
+    }
+
+    // predictNextText over many prompts. Generation depends only on the seed
+    // character, so each distinct seed is generated once, and all tokens of the
+    // batch are snapped together. incomplete, if given, flags the predictions
+    // predictNextText would have returned false for.
+    std::vector<std::string> predictNextTextBatch(std::span<const std::string> inputs, int maxChars = 50,
+                                                  std::vector<bool>* incomplete = nullptr) {
+        std::vector<std::string> results(inputs.size());
+        if (incomplete) incomplete->assign(inputs.size(), false);
+        if (inputs.empty()) return results;
+        VECTMO_METRICS_COUNT(Predictions, inputs.size());
+
+        auto model = acquireModel();
+        if (!model) {
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                results[i] = inputs[i].empty() ? "[No input provided]"
+                                               : "[Model not trained yet or file not found]";
+            }
+            return results;
+        }
+        VectmoArena::Scope scratch;
+        VectmoPredictor predictor(*model, VectmoPredictor::CYCLE_WINDOW_SIZE, scratch.resource());
+        if (beamWidth > 0) {
+            // Like greedy decoding, the result depends only on the seed character
+            std::array<int, 256> firstWithSeed;
+            firstWithSeed.fill(-1);
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                if (inputs[i].empty()) {
+                    results[i] = "[No input provided]";
+                    continue;
+                }
+                int& first = firstWithSeed[static_cast<unsigned char>(inputs[i].back())];
+                if (first >= 0) {
+                    results[i] = results[first];
+                    if (incomplete) (*incomplete)[i] = (*incomplete)[first];
+                    continue;
+                }
+                first = static_cast<int>(i);
+                predictor.resetSnapStatus();
+                predictor.beamSearch(inputs[i].back(), maxChars, beamWidth, results[i]);
+                if (results[i].empty()) results[i] = "[No continuation found]";
+                if (incomplete) (*incomplete)[i] = predictor.snapsIncomplete();
+            }
+            return results;
+        }
+        if (sampling) {
+            std::pmr::string rawSequence(scratch.resource());
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                if (inputs[i].empty()) {
+                    results[i] = "[No input provided]";
+                    continue;
+                }
+                bestSampledSequence(*model, predictor, inputs[i], samplingCandidates, maxChars, rawSequence);
+                if (rawSequence.size() <= 1) {
+                    results[i] = "[No continuation found]";
+                    continue;
+                }
+                predictor.resetSnapStatus();
+                predictor.snapToVocabulary(std::string_view(rawSequence).substr(1), results[i]);
+                if (incomplete) (*incomplete)[i] = predictor.snapsIncomplete();
+            }
+            return results;
+        }
+
+        constexpr int UNSEEN = -1;
+        constexpr int NO_CONTINUATION = -2;
+        std::array<int, 256> slotBySeed;
+        slotBySeed.fill(UNSEEN);
+        std::pmr::vector<std::pmr::string> rawOutputs(scratch.resource());
+        std::pmr::vector<int> slots(inputs.size(), -1, scratch.resource());
+        std::pmr::string rawSequence(scratch.resource());
+
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (inputs[i].empty()) {
+                results[i] = "[No input provided]";
+                continue;
+            }
+
+            char seed = inputs[i].back();
+            int& slot = slotBySeed[static_cast<unsigned char>(seed)];
+            if (slot == UNSEEN) {
+                predictor.generateRawSequenceInto(rawSequence, seed, maxChars);
+                if (rawSequence.size() <= 1) {
+                    slot = NO_CONTINUATION;
+                } else {
+                    slot = static_cast<int>(rawOutputs.size());
+                    rawOutputs.emplace_back(std::string_view(rawSequence).substr(1));  // remove seed
+                }
+            }
+            if (slot == NO_CONTINUATION) {
+                results[i] = "[No continuation found]";
+                continue;
+            }
+            slots[i] = slot;
+        }
+
+        std::vector<bool> unsnapped;
+        auto snapped = predictor.snapToVocabularyBatch(rawOutputs, &unsnapped);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (slots[i] < 0) continue;
+            results[i] = snapped[slots[i]];
+            if (incomplete) (*incomplete)[i] = unsnapped[slots[i]];
+        }
+        return results;
+    }
+
+    // count sampled continuations of inputText, best first; empty without a model.
+    // Draws from default-shaped tables when sampling is off.
+    std::vector<Candidate> predictCandidates(const std::string& inputText, int count, int maxChars = 50) {
+        if (inputText.empty() || count <= 0) return {};
+        auto model = acquireModel();
+        if (!model) return {};
+        VectmoArena::Scope scratch;
+        return rankCandidates(*model, inputText, count, maxChars);
+    }
+
+private:
+    // FNV-1a over the prompt, mixed with the configured seed and candidate number
+    uint64_t requestSeed(std::string_view prompt, int candidate) const {
+        uint64_t hash = 0xcbf29ce484222325ULL ^ samplingSeed;
+        for (char c : prompt) hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+        return hash ^ (static_cast<uint64_t>(candidate) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    // The best scoring of count sampled sequences, seed included, in out; the
+    // first of equal scores wins, as in rankCandidates. Only the winner needs a
+    // snap, so predictNextText does not snap the rest. Shorter than 2 chars if
+    // no draw produced a continuation.
+    void bestSampledSequence(const VectmoModel& model, const VectmoPredictor& predictor, std::string_view inputText,
+                             int count, int maxChars, std::pmr::string& out) const {
+        out.clear();
+        std::pmr::string rawSequence(out.get_allocator());
+        double bestScore = 0.0;
+        for (int c = 0; c < count; ++c) {
+            VectmoRandom rng(requestSeed(inputText, c));
+            predictor.generateSampledSequenceInto(rawSequence, inputText.back(), maxChars, rng);
+            if (rawSequence.size() <= 1) continue;
+            double score = model.scoreSequence(rawSequence);
+            if (out.size() > 1 && score <= bestScore) continue;
+            bestScore = score;
+            out.swap(rawSequence);
+        }
+    }
+
+    std::vector<Candidate> rankCandidates(const VectmoModel& model, const std::string& inputText, int count,
+                                          int maxChars) const {
+        VectmoPredictor predictor(model);
+        std::pmr::memory_resource* scratch = VectmoArena::scratch();
+        std::pmr::vector<std::pmr::string> rawOutputs(scratch);
+        std::pmr::vector<double> scores(scratch);
+        std::pmr::string rawSequence(scratch);
+        for (int c = 0; c < count; ++c) {
+            VectmoRandom rng(requestSeed(inputText, c));
+            predictor.generateSampledSequenceInto(rawSequence, inputText.back(), maxChars, rng);
+            if (rawSequence.size() <= 1) continue;
+            scores.push_back(model.scoreSequence(rawSequence));
+            rawOutputs.emplace_back(std::string_view(rawSequence).substr(1));  // remove seed
+        }
+
+        auto snapped = predictor.snapToVocabularyBatch(rawOutputs);
+        std::vector<Candidate> ranked(snapped.size());
+        for (size_t i = 0; i < ranked.size(); ++i) ranked[i] = {std::move(snapped[i]), scores[i]};
+        std::stable_sort(ranked.begin(), ranked.end(),
+                         [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+        return ranked;
+    }
+
+    std::shared_ptr<VectmoModel> makeModel() const {
+        auto model = std::make_shared<VectmoModel>();
+        model->setContextOrder(contextOrder);
+        model->setEmbeddingPrecision(embeddingPrecision);
+        model->setEmbeddingBuild(embeddingBuild);
+        model->setSamplingOptions(sampling.value_or(SamplingOptions{}));
+        if (indexFactory) model->setSimilarityIndex(indexFactory());
+        if (remoteVocabulary) model->setRemoteVocabulary(remoteVocabulary);
+        return model;
+    }
+
+    // Caller holds writerMutex
+    std::shared_ptr<VectmoModel> loadFromWorkingFiles() const {
+        auto next = makeModel();
+        // The binary model maps in place; the text files are the fallback
+        if (!next->loadBinary(workingFileBase + ".vbin") && !next->load(workingFileBase)) return nullptr;
+        next->setEmbeddingPrecision(embeddingPrecision, trainingThreads);
+        return next;
+    }
+
+    // Caller holds writerMutex
+    bool finishPretrain(const std::shared_ptr<VectmoModel>& next) {
+        if (!next->save(workingFileBase) || !next->saveBinary(workingFileBase + ".vbin")) {
+            std::cerr << "[PRETRAIN] ERROR: Failed to save model\n";
+            return false;
+        }
+
+        current.store(next);
+        *log << "[PRETRAIN] Model trained and saved successfully\n";
+        return true;
+    }
+
+    // Fast path is one atomic load; only the first call (or a race with it) loads
+    std::shared_ptr<const VectmoModel> acquireModel() {
+        if (auto model = current.load()) return model;
+
+        std::lock_guard<std::mutex> lock(writerMutex);
+        if (auto model = current.load()) return model;
+        auto next = loadFromWorkingFiles();
+        if (next) current.store(next);
+        return next;
+    }
+};
+
+// Snap-query line protocol between a coordinator and its shard servers. A request
+// line is one escaped token; its answer is "<score> <global row> <escaped word>",
+// or "-" when the shard has no match. Scores are written in shortest round-trip
+// form, so the coordinator compares exactly the doubles each shard computed.
+namespace VectmoWire {
+    // "%XX" for '%' and the bytes that frame lines and fields
+    inline void escape(std::string_view text, std::string& out) {
+        static constexpr char HEX[] = "0123456789ABCDEF";
+        for (char c : text) {
+            if (c != '%' && c != '\n' && c != '\r' && c != '\t' && c != ' ') {
+                out += c;
+                continue;
+            }
+            auto u = static_cast<unsigned char>(c);
+            out += '%';
+            out += HEX[u >> 4];
+            out += HEX[u & 15];
+        }
+    }
+
+    inline bool unescape(std::string_view text, std::string& out) {
+        out.clear();
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '%') {
+                out += text[i];
+                continue;
+            }
+            unsigned value = 0;
+            if (text.size() - i < 3) return false;
+            auto [end, ec] = std::from_chars(text.data() + i + 1, text.data() + i + 3, value, 16);
+            if (ec != std::errc() || end != text.data() + i + 3) return false;
+            out += static_cast<char>(value);
+            i += 2;
+        }
+        return true;
+    }
+
+    // Batch handler for a shard server; lines that do not decode get "-"
+    inline std::vector<std::string> answerSnapQueries(const VectmoModel& model, std::span<const std::string> lines) {
+        std::vector<std::string> tokens(lines.size());
+        std::vector<std::string_view> asked;
+        std::vector<size_t> positions;
+        for (size_t j = 0; j < lines.size(); ++j) {
+            if (!unescape(lines[j], tokens[j]) || tokens[j].empty()) continue;
+            asked.push_back(tokens[j]);
+            positions.push_back(j);
+        }
+        std::vector<std::optional<VectmoModel::SnapMatch>> matches(asked.size());
+        model.findSnapMatches(asked, matches);
+
+        std::vector<std::string> answers(lines.size(), "-");
+        for (size_t m = 0; m < matches.size(); ++m) {
+            if (!matches[m]) continue;
+            std::string& answer = answers[positions[m]];
+            char number[32];
+            auto end = std::to_chars(number, number + sizeof(number), matches[m]->score).ptr;
+            answer.assign(number, end);
+            answer += ' ';
+            answer += std::to_string(matches[m]->row);
+            answer += ' ';
+            escape(matches[m]->word, answer);
+        }
+        return answers;
+    }
+
+    struct SnapAnswer {
+        double score = 0.0;
+        uint64_t row = 0;
+        std::string word;
+    };
+
+    // False for a malformed line; a well-formed "-" leaves out empty
+    inline bool parseSnapAnswer(std::string_view line, std::optional<SnapAnswer>& out) {
+        out.reset();
+        if (line == "-") return true;
+        size_t first = line.find(' ');
+        size_t second = first == std::string_view::npos ? first : line.find(' ', first + 1);
+        if (second == std::string_view::npos) return false;
+        SnapAnswer answer;
+        auto [scoreEnd, scoreError] = std::from_chars(line.data(), line.data() + first, answer.score);
+        auto [rowEnd, rowError] = std::from_chars(line.data() + first + 1, line.data() + second, answer.row);
+        if (scoreError != std::errc() || scoreEnd != line.data() + first || rowError != std::errc() ||
+            rowEnd != line.data() + second || !unescape(line.substr(second + 1), answer.word)) {
+            return false;
+        }
+        out = std::move(answer);
+        return true;
+    }
+}
+
+// Gathers prompts submitted from many threads into micro-batches for
+// Vectmo::predictNextTextBatch (or any other batch handler), so concurrent
+// callers share seed generation and one snap pass. A batch closes when it holds maxBatch prompts, or once one of
+// its prompts has waited maxWait or half the time left to its deadline.
+// The queue is bounded: trySubmit() refuses work once `capacity` prompts wait.
+// A prompt whose deadline passes before its batch starts is answered
+// "[Deadline exceeded]" without being generated. A Vectmo answer left partly
+// unsnapped is prefixed with Vectmo::VOCABULARY_UNREACHABLE and a space.
+class VectmoBatchScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Completion = std::function<void(std::string prediction)>;
+    // Gets each batch and returns one answer per request, in order
+    using BatchHandler = std::function<std::vector<std::string>(std::span<const std::string> requests)>;
+
+    static constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+    struct Options {
+        size_t maxBatch = 64;
+        std::chrono::microseconds maxWait{1000};
+        size_t capacity = 4096;
+        unsigned workers = 1;
+        int maxChars = 50;
+    };
+
+private:
+    struct Request {
+        std::string prompt;
+        Clock::time_point arrival;
+        Clock::time_point deadline;
+        Completion done;
+    };
+
+    BatchHandler handler;
+    Options options;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Request> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    // Caller holds mutex; the batch is the first maxBatch queued prompts
+    Clock::time_point batchCloses() const {
+        Clock::time_point close = Clock::time_point::max();
+        size_t n = std::min(queue.size(), options.maxBatch);
+        for (size_t i = 0; i < n; ++i) {
+            const Request& request = queue[i];
+            Clock::duration wait = std::min<Clock::duration>(options.maxWait, (request.deadline - request.arrival) / 2);
+            close = std::min(close, request.arrival + wait);
+        }
+        return close;
+    }
+
+    void run() {
+        std::vector<Request> batch;
+        std::vector<std::string> prompts;
+        for (;;) {
+            batch.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;  // stopping, and everything queued is answered
+                while (!stopping && !queue.empty() && queue.size() < options.maxBatch &&
+                       Clock::now() < batchCloses()) {
+                    wake.wait_until(lock, batchCloses());
+                }
+                size_t n = std::min(queue.size(), options.maxBatch);
+                for (size_t i = 0; i < n; ++i) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                if (!queue.empty()) wake.notify_one();  // the rest is another worker's batch
+            }
+            if (batch.empty()) continue;  // another worker took it while we waited
+            VECTMO_METRICS_COUNT(ScheduledBatches, 1);
+
+            auto now = Clock::now();
+            prompts.clear();
+            size_t live = 0;
+            for (auto& request : batch) {
+                if (request.deadline <= now) {
+                    VECTMO_METRICS_COUNT(DeadlineMisses, 1);
+                    request.done("[Deadline exceeded]");
+                    request.done = nullptr;
+                    continue;
+                }
+                prompts.push_back(std::move(request.prompt));
+                ++live;
+            }
+            if (live == 0) continue;
+
+            auto predictions = handler(prompts);
+            size_t next = 0;
+            for (auto& request : batch) {
+                if (request.done) request.done(std::move(predictions[next++]));
+            }
+        }
+    }
+
+public:
+    // vectmo must outlive the scheduler and be configured before it starts
+    VectmoBatchScheduler(Vectmo& vectmo, Options options)
+        : VectmoBatchScheduler(
+              [&vectmo, maxChars = options.maxChars](std::span<const std::string> prompts) {
+                  std::vector<bool> incomplete;
+                  auto predictions = vectmo.predictNextTextBatch(prompts, maxChars, &incomplete);
+                  for (size_t i = 0; i < predictions.size(); ++i) {
+                      if (!incomplete[i]) continue;
+                      predictions[i].insert(0, " ");
+                      predictions[i].insert(0, Vectmo::VOCABULARY_UNREACHABLE);
+                  }
+                  return predictions;
+              },
+              options) {}
+
+    VectmoBatchScheduler(BatchHandler batchHandler, Options options)
+        : handler(std::move(batchHandler)), options(options) {
+        this->options.maxBatch = std::max<size_t>(this->options.maxBatch, 1);
+        for (unsigned i = 0; i < std::max(options.workers, 1u); ++i) workers.emplace_back([this] { run(); });
+    }
+
+    // Answers everything already queued before returning
+    ~VectmoBatchScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    VectmoBatchScheduler(const VectmoBatchScheduler&) = delete;
+    VectmoBatchScheduler& operator=(const VectmoBatchScheduler&) = delete;
+
+    // done runs on a worker thread with the prediction. False, without calling
+    // done, when the queue is full or the scheduler is shutting down.
+    bool trySubmit(std::string prompt, Clock::time_point deadline, Completion done) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || queue.size() >= options.capacity) return false;
+            queue.push_back({std::move(prompt), Clock::now(), deadline, std::move(done)});
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+};
+
+#ifdef VECTMO_HAS_SOCKETS
+// Socket plumbing shared by VectmoServer and VectmoShardClient
+namespace VectmoNet {
+    inline bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // "PORT" means loopback; "[v6]:PORT" brackets are stripped
+    inline std::pair<std::string, std::string> splitHostPort(const std::string& hostPort) {
+        size_t colon = hostPort.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : hostPort.substr(0, colon);
+        std::string port = colon == std::string::npos ? hostPort : hostPort.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        return {host, port};
+    }
+
+    inline bool unixAddress(const std::string& path, sockaddr_un& address) {
+        address = {};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    // Starts a non-blocking connect to "unix:PATH" or "[HOST:]PORT"; -1 on failure.
+    // The socket turns writable once connected; check SO_ERROR then.
+    inline int connectTo(const std::string& address) {
+        if (address.rfind("unix:", 0) == 0) {
+            sockaddr_un unixPath;
+            if (!unixAddress(address.substr(5), unixPath)) return -1;
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) return -1;
+            if (!setNonBlocking(fd) ||
+                (::connect(fd, reinterpret_cast<const sockaddr*>(&unixPath), sizeof(unixPath)) != 0 &&
+                 errno != EINPROGRESS && errno != EAGAIN)) {
+                ::close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        auto [host, port] = splitHostPort(address);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+        int fd = -1;
+        for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next) {
+            fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if (!setNonBlocking(fd) || (::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(found);
+        return fd;
+    }
+}
+
+// Line-protocol prediction service on a Unix or TCP socket: one poll() thread
+// in front of a VectmoBatchScheduler, sharing the Vectmo's published model.
+// Every request line is a prompt, optionally prefixed "<deadline-ms>\t", and
+// gets exactly one response line, marked as VectmoBatchScheduler describes;
+// responses keep request order per connection, so clients may pipeline.
+// Backpressure is plain flow control: a connection is not read while it has
+// maxInFlight unanswered requests or a megabyte of unsent output, and lines the
+// full scheduler refused wait in its input buffer.
+class VectmoServer {
+public:
+    using Clock = VectmoBatchScheduler::Clock;
+
+    struct Options {
+        VectmoBatchScheduler::Options batching;
+        std::chrono::milliseconds defaultDeadline{0};  // 0 = none
+        size_t maxInFlight = 256;                       // per connection
+        size_t maxLineBytes = 64 * 1024;
+    };
+
+private:
+    static constexpr size_t READ_CHUNK = 16 * 1024;
+    static constexpr size_t OUTPUT_HIGH_WATER = 1 << 20;
+#ifdef MSG_NOSIGNAL
+    static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static constexpr int SEND_FLAGS = 0;
+#endif
+
+    struct Connection {
+        int fd = -1;
+        std::string input;   // received, not yet submitted
+        std::string output;  // answered, not yet sent
+        size_t outputSent = 0;
+        uint64_t nextSeq = 0;     // sequence number of the next request
+        uint64_t nextToSend = 0;  // first request not yet in output
+        std::map<uint64_t, std::string> ready;  // answered ahead of nextToSend
+        bool readClosed = false;
+        bool broken = false;
+
+        size_t unanswered() const { return static_cast<size_t>(nextSeq - nextToSend); }
+        bool finished() const {
+            return broken || (readClosed && input.empty() && unanswered() == 0 && outputSent == output.size());
+        }
+    };
+
+    struct Answer {
+        uint64_t connection;
+        uint64_t seq;
+        std::string text;
+    };
+
+    Options options;
+    int listener = -1;
+    std::string unixPath;
+    int wakeRead = -1;
+    int wakeWrite = -1;
+    std::atomic<int> stopRequests{0};
+    std::unordered_map<uint64_t, Connection> connections;
+    uint64_t nextConnection = 0;
+    std::mutex answersMutex;
+    std::vector<Answer> answers;  // filled by scheduler workers, drained by run()
+    std::unique_ptr<VectmoBatchScheduler> scheduler;
+
+    static bool setNonBlocking(int fd) { return VectmoNet::setNonBlocking(fd); }
+
+    void openWakePipe() {
+        int fds[2];
+        if (::pipe(fds) != 0) return;
+        if (setNonBlocking(fds[0]) && setNonBlocking(fds[1])) {
+            wakeRead = fds[0];
+            wakeWrite = fds[1];
+            return;
+        }
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    void wake() const {
+        char byte = 0;
+        [[maybe_unused]] ssize_t n = ::write(wakeWrite, &byte, 1);  // a full pipe is awake already
+    }
+
+    // Scheduler worker side
+    void onAnswer(uint64_t connection, uint64_t seq, std::string text) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(answersMutex);
+            first = answers.empty();
+            answers.push_back({connection, seq, std::move(text)});
+        }
+        if (first) wake();
+    }
+
+    void deliver(Connection& conn, uint64_t seq, std::string text) {
+        conn.ready.emplace(seq, std::move(text));
+        while (!conn.ready.empty() && conn.ready.begin()->first == conn.nextToSend) {
+            std::string& line = conn.ready.begin()->second;
+            std::replace(line.begin(), line.end(), '\n', ' ');  // one line per answer
+            std::replace(line.begin(), line.end(), '\r', ' ');
+            conn.output += line;
+            conn.output += '\n';
+            conn.ready.erase(conn.ready.begin());
+            ++conn.nextToSend;
+        }
+    }
+
+    bool submit(uint64_t id, uint64_t seq, std::string_view line) {
+        auto now = Clock::now();
+        auto deadline = options.defaultDeadline.count() > 0 ? now + options.defaultDeadline
+                                                           : VectmoBatchScheduler::NO_DEADLINE;
+        size_t tab = line.find('\t');
+        if (tab != std::string_view::npos && tab > 0) {
+            long long ms = 0;
+            auto [end, ec] = std::from_chars(line.data(), line.data() + tab, ms);
+            if (ec == std::errc() && end == line.data() + tab && ms >= 0) {
+                deadline = ms > 0 ? now + std::chrono::milliseconds(ms) : VectmoBatchScheduler::NO_DEADLINE;
+                line.remove_prefix(tab + 1);
+            }
+        }
+        return scheduler->trySubmit(std::string(line), deadline, [this, id, seq](std::string text) {
+            onAnswer(id, seq, std::move(text));
+        });
+    }
+
+    // Submits buffered lines until the connection or the scheduler is at its limit
+    void submitLines(uint64_t id, Connection& conn) {
+        size_t start = 0;
+        while (conn.unanswered() < options.maxInFlight) {
+            size_t end = conn.input.find('\n', start);
+            if (end == std::string::npos && (!conn.readClosed || start == conn.input.size())) break;
+            size_t stop = end == std::string::npos ? conn.input.size() : end;
+            std::string_view line(conn.input.data() + start, stop - start);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (!submit(id, conn.nextSeq, line)) break;  // retried once answers free the queue
+            ++conn.nextSeq;
+            start = end == std::string::npos ? stop : end + 1;
+        }
+        conn.input.erase(0, start);
+        if (!conn.readClosed && conn.input.size() > options.maxLineBytes &&
+            conn.input.find('\n') == std::string::npos) {
+            conn.input.clear();
+            conn.readClosed = true;
+            deliver(conn, conn.nextSeq++, "[Request too long]");
+        }
+    }
+
+    bool wantsRead(const Connection& conn) const {
+        return !conn.readClosed && conn.unanswered() < options.maxInFlight &&
+               conn.output.size() - conn.outputSent < OUTPUT_HIGH_WATER &&
+               conn.input.find('\n') == std::string::npos;
+    }
+
+    void readSome(Connection& conn) {
+        char buffer[READ_CHUNK];
+        ssize_t n = ::recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            conn.input.append(buffer, static_cast<size_t>(n));
+        } else if (n == 0) {
+            conn.readClosed = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn.broken = true;
+        }
+    }
+
+    void flushOutput(Connection& conn) {
+        while (conn.outputSent < conn.output.size()) {
+            ssize_t n = ::send(conn.fd, conn.output.data() + conn.outputSent, conn.output.size() - conn.outputSent,
+                               SEND_FLAGS);
+            if (n > 0) {
+                conn.outputSent += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) conn.broken = true;
+            break;
+        }
+        if (conn.outputSent == conn.output.size()) {
+            conn.output.clear();
+            conn.outputSent = 0;
+        }
+    }
+
+    void acceptAll() {
+        for (;;) {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;  // EAGAIN, or a connection that died before we got to it
+            }
+            if (!setNonBlocking(fd)) {
+                ::close(fd);
+                continue;
+            }
+            if (unixPath.empty()) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            connections[nextConnection++].fd = fd;
+        }
+    }
+
+    void drainAnswers() {
+        char buffer[256];
+        while (::read(wakeRead, buffer, sizeof(buffer)) > 0) {
+        }
+        std::vector<Answer> batch;
+        {
+            std::lock_guard<std::mutex> lock(answersMutex);
+            batch.swap(answers);
+        }
+        for (auto& answer : batch) {
+            auto it = connections.find(answer.connection);
+            if (it == connections.end()) continue;  // closed while its request ran
+            deliver(it->second, answer.seq, std::move(answer.text));
+            flushOutput(it->second);
+        }
+    }
+
+    void closeListener() {
+        if (listener < 0) return;
+        ::close(listener);
+        listener = -1;
+        if (!unixPath.empty()) ::unlink(unixPath.c_str());
+    }
+
+    bool bindAndListen(int fd, const sockaddr* address, socklen_t length) {
+        if (::bind(fd, address, length) != 0 || ::listen(fd, SOMAXCONN) != 0 || !setNonBlocking(fd)) {
+            ::close(fd);
+            return false;
+        }
+        listener = fd;
+        return true;
+    }
+
+    bool listenUnix(const std::string& path) {
+        sockaddr_un address;
+        if (!VectmoNet::unixAddress(path, address)) return false;
+        struct stat info;
+        if (::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) ::unlink(path.c_str());  // stale socket
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || !bindAndListen(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address))) return false;
+        unixPath = path;
+        return true;
+    }
+
+    bool listenTcp(const std::string& hostPort) {
+        auto [host, port] = VectmoNet::splitHostPort(hostPort);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* found = nullptr;
+        if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) return false;
+        bool ok = false;
+        for (addrinfo* ai = found; ai && !ok; ai = ai->ai_next) {
+            int fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            ok = bindAndListen(fd, ai->ai_addr, ai->ai_addrlen);
+        }
+        ::freeaddrinfo(found);
+        return ok;
+    }
+
+public:
+    // vectmo must outlive the server and be configured before it starts
+    VectmoServer(Vectmo& vectmo, Options options) : options(options) {
+        openWakePipe();
+        scheduler = std::make_unique<VectmoBatchScheduler>(vectmo, options.batching);
+    }
+
+    // Serves another line protocol, such as VectmoWire::answerSnapQueries for a shard
+    VectmoServer(VectmoBatchScheduler::BatchHandler handler, Options options) : options(options) {
+        openWakePipe();
+        scheduler = std::make_unique<VectmoBatchScheduler>(std::move(handler), options.batching);
+    }
+
+    ~VectmoServer() {
+        scheduler.reset();  // joins the workers, whose answers still write to the wake pipe
+        for (auto& [id, conn] : connections) ::close(conn.fd);
+        closeListener();
+        if (wakeRead >= 0) ::close(wakeRead);
+        if (wakeWrite >= 0) ::close(wakeWrite);
+    }
+
+    VectmoServer(const VectmoServer&) = delete;
+    VectmoServer& operator=(const VectmoServer&) = delete;
+
+    // "unix:PATH", "PORT" (loopback only) or "HOST:PORT"; an existing socket at PATH is replaced
+    bool listen(const std::string& address) {
+        errno = 0;
+        bool ok = wakeRead >= 0 && listener < 0 &&
+                  (address.rfind("unix:", 0) == 0 ? listenUnix(address.substr(5)) : listenTcp(address));
+        if (!ok) {
+            std::cerr << "[ERROR] Cannot listen on " << address << ": "
+                      << (errno != 0 ? std::strerror(errno) : "bad address") << '\n';
+        }
+        return ok;
+    }
+
+    // The bound TCP port, useful after listening on port 0; 0 for Unix sockets
+    int port() const {
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        if (listener < 0 || !unixPath.empty() ||
+            ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            return 0;
+        }
+        if (address.ss_family == AF_INET) return ntohs(reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+        if (address.ss_family == AF_INET6) return ntohs(reinterpret_cast<sockaddr_in6*>(&address)->sin6_port);
+        return 0;
+    }
+
+    // Safe from a signal handler. The first call stops accepting and reading
+    // and lets accepted requests be answered; a second one makes run() return now.
+    void stop() {
+        stopRequests.fetch_add(1, std::memory_order_relaxed);
+        wake();
+    }
+
+    // Serves on the calling thread until stop(); false if it could not start
+    bool run() {
+        if (listener < 0) return false;
+        std::vector<pollfd> fds;
+        std::vector<uint64_t> ids;
+        for (;;) {
+            int stops = stopRequests.load(std::memory_order_relaxed);
+            if (stops >= 2) break;
+            if (stops == 1 && listener >= 0) {
+                closeListener();
+                for (auto& [id, conn] : connections) {
+                    conn.readClosed = true;
+                    conn.input.clear();
+                }
+            }
+            for (auto it = connections.begin(); it != connections.end();) {
+                submitLines(it->first, it->second);
+                if (!it->second.finished()) {
+                    ++it;
+                    continue;
+                }
+                ::close(it->second.fd);
+                it = connections.erase(it);
+            }
+            if (stops == 1 && connections.empty()) break;
+
+            fds.clear();
+            ids.clear();
+            fds.push_back({wakeRead, POLLIN, 0});
+            if (listener >= 0) fds.push_back({listener, POLLIN, 0});
+            size_t first = fds.size();
+            for (const auto& [id, conn] : connections) {
+                short events = 0;
+                if (wantsRead(conn)) events |= POLLIN;
+                if (conn.outputSent < conn.output.size()) events |= POLLOUT;
+                fds.push_back({conn.fd, events, 0});
+                ids.push_back(id);
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "[ERROR] poll failed: " << std::strerror(errno) << '\n';
+                return false;
+            }
+
+            if (fds[0].revents) drainAnswers();
+            if (listener >= 0 && fds[1].revents) acceptAll();
+            for (size_t i = first; i < fds.size(); ++i) {
+                auto it = connections.find(ids[i - first]);
+                if (it == connections.end() || fds[i].revents == 0) continue;
+                Connection& conn = it->second;
+                if (fds[i].revents & POLLIN) readSome(conn);
+                if (fds[i].revents & POLLOUT) flushOutput(conn);
+                // The peer is gone for good once nothing more can be read
+                if ((fds[i].revents & POLLERR) || ((fds[i].revents & POLLHUP) && !(fds[i].revents & POLLIN))) {
+                    conn.broken = true;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// Coordinator side of a sharded vocabulary: each snap batch goes to every shard
+// server (a VectmoServer answering VectmoWire snap queries) and the shards' best
+// matches are merged by score, then word length, then global row, the same order
+// as one exact search over the whole vocabulary. A shard may have replicas: if
+// its first replica has not answered after hedgeDelay the batch is also sent to
+// the next one, and whichever answers first wins. A token whose shard cannot be
+// reached gets no match for that call.
+class VectmoShardClient : public RemoteVocabulary {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        std::chrono::milliseconds hedgeDelay{20};
+        std::chrono::milliseconds timeout{2000};
+    };
+
+private:
+    struct Connection {
+        int fd = -1;
+        bool connecting = false;
+        std::string output;
+        size_t outputSent = 0;
+        std::string input;
+        size_t discard = 0;  // answers still due to a batch another replica won
+        bool asked = false;  // working on the current batch
+        std::vector<std::string> answers;
+
+        void close() {
+            if (fd >= 0) ::close(fd);
+            *this = Connection{};
+        }
+    };
+
+    // One connection per replica of every shard; a call holds a lane to itself
+    struct Lane {
+        std::vector<std::vector<Connection>> replicas;
+        ~Lane() {
+            for (auto& shard : replicas) {
+                for (auto& conn : shard) conn.close();
+            }
+        }
+    };
+
+    std::vector<std::vector<std::string>> shards;
+    Options options;
+    mutable std::mutex lanesMutex;
+    mutable std::vector<std::unique_ptr<Lane>> idleLanes;
+    mutable std::atomic<size_t> nextFirstReplica{0};
+
+    std::unique_ptr<Lane> checkoutLane() const {
+        {
+            std::lock_guard<std::mutex> lock(lanesMutex);
+            if (!idleLanes.empty()) {
+                auto lane = std::move(idleLanes.back());
+                idleLanes.pop_back();
+                return lane;
+            }
+        }
+        auto lane = std::make_unique<Lane>();
+        lane->replicas.resize(shards.size());
+        for (size_t s = 0; s < shards.size(); ++s) lane->replicas[s].resize(shards[s].size());
+        return lane;
+    }
+
+    void returnLane(std::unique_ptr<Lane> lane) const {
+        std::lock_guard<std::mutex> lock(lanesMutex);
+        idleLanes.push_back(std::move(lane));
+    }
+
+    // Queues the batch on replica r, connecting first if needed
+    bool ask(Connection& conn, const std::string& address, const std::string& payload) const {
+        if (conn.fd < 0) {
+            conn.fd = VectmoNet::connectTo(address);
+            conn.connecting = conn.fd >= 0;
+            if (conn.fd < 0) return false;
+        }
+        conn.output += payload;
+        conn.asked = true;
+        conn.answers.clear();
+        return true;
+    }
+
+    // Sends what it can and reads whole lines; false once the connection is dead
+    bool pump(Connection& conn, short revents, size_t expected) const {
+        if (conn.connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) return false;
+            conn.connecting = false;
+        }
+        if (conn.connecting) return true;
+        while (conn.outputSent < conn.output.size()) {
+            ssize_t n = ::send(conn.fd, conn.output.data() + conn.outputSent, conn.output.size() - conn.outputSent,
+#ifdef MSG_NOSIGNAL
+                               MSG_NOSIGNAL);
+#else
+                               0);
+#endif
+            if (n > 0) {
+                conn.outputSent += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        if (conn.outputSent == conn.output.size()) {
+            conn.output.clear();
+            conn.outputSent = 0;
+        }
+        if (!(revents & (POLLIN | POLLHUP | POLLERR))) return true;
+
+        char buffer[16 * 1024];
+        ssize_t n = ::recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n == 0) return false;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        conn.input.append(buffer, static_cast<size_t>(n));
+        size_t start = 0;
+        for (size_t end; (end = conn.input.find('\n', start)) != std::string::npos; start = end + 1) {
+            if (conn.discard > 0) {
+                --conn.discard;
+            } else if (conn.asked && conn.answers.size() < expected) {
+                conn.answers.emplace_back(conn.input, start, end - start);
+            }
+        }
+        conn.input.erase(0, start);
+        return true;
+    }
+
+    // Sends payload to every shard and collects one complete answer list per
+    // shard; a shard left empty could not be reached
+    void fanOut(Lane& lane, const std::string& payload, size_t expected,
+                std::vector<const std::vector<std::string>*>& answered) const {
+        size_t shardCount = shards.size();
+        std::vector<size_t> asked(shardCount, 0);  // replicas tried so far
+        size_t first = nextFirstReplica.fetch_add(1, std::memory_order_relaxed);
+        auto replicaOf = [&](size_t s, size_t k) { return (first + k) % shards[s].size(); };
+        auto askNext = [&](size_t s) {
+            while (asked[s] < shards[s].size()) {
+                size_t r = replicaOf(s, asked[s]++);
+                Connection& conn = lane.replicas[s][r];
+                if (conn.asked) continue;
+                if (ask(conn, shards[s][r], payload)) return true;
+                conn.close();
+            }
+            return false;
+        };
+        auto live = [&](size_t s) {
+            return std::any_of(lane.replicas[s].begin(), lane.replicas[s].end(),
+                               [](const Connection& c) { return c.asked; });
+        };
+
+        std::vector<bool> settled(shardCount, false);
+        size_t open = shardCount;
+        for (size_t s = 0; s < shardCount; ++s) {
+            if (!askNext(s)) {
+                settled[s] = true;
+                --open;
+            }
+        }
+
+        auto start = Clock::now();
+        auto deadline = start + options.timeout;
+        auto nextHedge = start + options.hedgeDelay;
+        std::vector<pollfd> fds;
+        std::vector<std::pair<size_t, size_t>> owners;
+        while (open > 0) {
+            fds.clear();
+            owners.clear();
+            for (size_t s = 0; s < shardCount; ++s) {
+                if (settled[s]) continue;
+                for (size_t r = 0; r < lane.replicas[s].size(); ++r) {
+                    Connection& conn = lane.replicas[s][r];
+                    if (!conn.asked) continue;
+                    short events = POLLIN;
+                    if (conn.connecting || conn.outputSent < conn.output.size()) events |= POLLOUT;
+                    fds.push_back({conn.fd, events, 0});
+                    owners.push_back({s, r});
+                }
+            }
+            auto now = Clock::now();
+            if (now >= deadline) break;
+            auto wakeAt = std::min(deadline, nextHedge);
+            int waitMs = static_cast<int>(
+                std::chrono::ceil<std::chrono::milliseconds>(std::max(wakeAt - now, Clock::duration::zero())).count());
+            if (::poll(fds.data(), fds.size(), waitMs) < 0 && errno != EINTR) break;
+
+            for (size_t i = 0; i < fds.size(); ++i) {
+                auto [s, r] = owners[i];
+                Connection& conn = lane.replicas[s][r];
+                if (settled[s] || !conn.asked) continue;
+                if (!pump(conn, fds[i].revents, expected)) {
+                    conn.close();
+                    if (!live(s) && !askNext(s)) {
+                        settled[s] = true;
+                        --open;
+                    }
+                    continue;
+                }
+                if (conn.answers.size() < expected) continue;
+                // First complete answer wins; slower replicas skip theirs later
+                answered[s] = &conn.answers;
+                settled[s] = true;
+                --open;
+                for (auto& other : lane.replicas[s]) {
+                    if (&other == &conn || !other.asked) continue;
+                    other.discard += expected - other.answers.size();
+                    other.asked = false;
+                    other.answers.clear();
+                }
+                conn.asked = false;
+            }
+
+            if (Clock::now() >= nextHedge) {
+                for (size_t s = 0; s < shardCount; ++s) {
+                    if (!settled[s] && asked[s] < shards[s].size() && askNext(s)) {
+                        VECTMO_METRICS_COUNT(HedgedRequests, 1);
+                    }
+                }
+                nextHedge = Clock::now() + options.hedgeDelay;
+            }
+        }
+
+        // Whatever is still outstanding has an unknown number of answers in flight
+        for (size_t s = 0; s < shardCount; ++s) {
+            if (answered[s]) continue;
+            for (auto& conn : lane.replicas[s]) {
+                if (conn.asked) conn.close();
+            }
+        }
+    }
+
+public:
+    // shards[i] lists the addresses ("unix:PATH", "PORT" or "HOST:PORT") of the
+    // replicas serving shard i; shard order does not matter
+    VectmoShardClient(std::vector<std::vector<std::string>> shardReplicas, Options opts)
+        : shards(std::move(shardReplicas)), options(opts) {}
+
+    // A batch some shard could not answer is left unsnapped, counted as a
+    // ShardFailures metric and reported by returning false
+    bool findNearest(std::span<const std::string_view> tokens, std::span<std::optional<std::string_view>> best,
+                     std::pmr::memory_resource* storage) const override {
+        std::fill(best.begin(), best.end(), std::nullopt);
+        if (tokens.empty()) return true;
+        if (shards.empty()) return false;
+        std::string payload;
+        for (std::string_view token : tokens) {
+            VectmoWire::escape(token, payload);
+            payload += '\n';
+        }
+
+        auto lane = checkoutLane();
+        std::vector<const std::vector<std::string>*> answered(shards.size(), nullptr);
+        fanOut(*lane, payload, tokens.size(), answered);
+        bool complete = std::all_of(answered.begin(), answered.end(), [](auto* a) { return a != nullptr; });
+        if (!complete) {
+            VECTMO_METRICS_COUNT(ShardFailures, 1);
+        } else {
+            std::optional<VectmoWire::SnapAnswer> answer;
+            for (size_t j = 0; j < tokens.size(); ++j) {
+                std::optional<VectmoWire::SnapAnswer> winner;
+                bool valid = true;
+                for (const auto* lines : answered) {
+                    if (!VectmoWire::parseSnapAnswer((*lines)[j], answer)) {
+                        valid = false;
+                        break;
+                    }
+                    if (!answer) continue;
+                    // Ties that isBetterMatch leaves open go to the lower global row
+                    if (!winner ||
+                        SimilarityIndex::isBetterMatch(answer->score, answer->word.size(), winner->score,
+                                                       winner->word.size(), tokens[j].size()) ||
+                        (!SimilarityIndex::isBetterMatch(winner->score, winner->word.size(), answer->score,
+                                                         answer->word.size(), tokens[j].size()) &&
+                         answer->row < winner->row)) {
+                        winner = std::move(answer);
+                    }
+                }
+                if (valid && winner) best[j] = VectmoArena::copy(winner->word, storage);
+            }
+        }
+        // Clear the winners' buffers before the lane is reused
+        for (auto& shard : lane->replicas) {
+            for (auto& conn : shard) conn.answers.clear();
+        }
+        returnLane(std::move(lane));
+        return complete;
+    }
+};
+#endif